@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "arena.h"
+
+#include <cstring>
+
+std::string_view Arena::intern(std::string_view str)
+{
+	auto it = strings.find(str);
+	if (it != strings.end())
+	{
+		return *it;
+	}
+
+	char *copy = static_cast<char *>(resource.allocate(str.size() + 1, 1));
+	std::memcpy(copy, str.data(), str.size());
+	copy[str.size()] = '\0';
+	return *strings.emplace(copy, str.size()).first;
+}
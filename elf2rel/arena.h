@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <memory_resource>
+#include <string_view>
+#include <unordered_set>
+
+// Monotonic allocator for data that lives as long as a conversion or a symbol
+// map. Nothing is freed before the arena itself is destroyed, which releases
+// everything at once.
+class Arena
+{
+public:
+	Arena() = default;
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	std::pmr::memory_resource *getResource() { return &resource; }
+
+	// Returns a copy of str owned by the arena, equal strings share a single
+	// copy. The copy is null terminated so data() can be used as a C string.
+	std::string_view intern(std::string_view str);
+
+private:
+	std::pmr::monotonic_buffer_resource resource;
+	std::pmr::unordered_set<std::string_view> strings{ &resource };
+};
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "cache.h"
+
+#include "elf2rel.h"
+
+#include <fstream>
+#include <iterator>
+
+// Cache files start with this magic, followed by a version and the section
+// count. Each section is its key, context hash and the symbol, relocation and
+// patch counts followed by the symbols, relocations and patches.
+const uint32_t cRelocationCacheMagic = 0x45325243; // 'E2RC'
+const uint32_t cRelocationCacheVersion = 2;
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+void loadRelocationCache(const std::string &filename, RelocationCache &cache)
+{
+	std::ifstream inputStream(filename, std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(inputStream)), std::istreambuf_iterator<char>());
+
+	const size_t headerSize = 12;
+	const size_t sectionHeaderSize = 28;
+	const size_t symbolSize = 4;
+	const size_t relocationSize = 16;
+	const size_t patchSize = 8;
+	if (data.size() < headerSize
+		|| loadAt<uint32_t>(data, 0) != cRelocationCacheMagic
+		|| loadAt<uint32_t>(data, 4) != cRelocationCacheVersion)
+	{
+		return;
+	}
+
+	RelocationCache fileCache;
+	uint32_t sectionCount = loadAt<uint32_t>(data, 8);
+	size_t offset = headerSize;
+	for (uint32_t i = 0; i < sectionCount; ++i)
+	{
+		if (offset + sectionHeaderSize > data.size())
+		{
+			return;
+		}
+		uint64_t key = loadAt<uint64_t>(data, offset);
+		CachedSection section;
+		section.contextHash = loadAt<uint64_t>(data, offset + 8);
+		uint64_t symbolCount = loadAt<uint32_t>(data, offset + 16);
+		uint64_t relocationCount = loadAt<uint32_t>(data, offset + 20);
+		uint64_t patchCount = loadAt<uint32_t>(data, offset + 24);
+		offset += sectionHeaderSize;
+		if (symbolCount * symbolSize + relocationCount * relocationSize + patchCount * patchSize > data.size() - offset)
+		{
+			return;
+		}
+
+		section.symbols.resize(symbolCount);
+		for (auto &symbol : section.symbols)
+		{
+			symbol = loadAt<uint32_t>(data, offset);
+			offset += symbolSize;
+		}
+		section.relocations.resize(relocationCount);
+		for (auto &rel : section.relocations)
+		{
+			rel.offset = loadAt<uint32_t>(data, offset);
+			rel.addend = loadAt<uint32_t>(data, offset + 4);
+			rel.symbol = loadAt<uint32_t>(data, offset + 8);
+			rel.targetSection = loadAt<uint16_t>(data, offset + 12);
+			rel.type = loadAt<uint8_t>(data, offset + 14);
+			rel.resolvedEarly = loadAt<uint8_t>(data, offset + 15) != 0;
+			offset += relocationSize;
+		}
+		section.patches.resize(patchCount);
+		for (auto &patch : section.patches)
+		{
+			patch.offset = static_cast<int32_t>(loadAt<uint32_t>(data, offset));
+			patch.value = loadAt<uint32_t>(data, offset + 4);
+			offset += patchSize;
+		}
+		fileCache.sections[key] = std::move(section);
+	}
+	cache = std::move(fileCache);
+}
+
+bool writeRelocationCache(const std::string &filename, const RelocationCache &cache)
+{
+	std::vector<uint8_t> buffer;
+	save<uint32_t>(buffer, cRelocationCacheMagic);
+	save<uint32_t>(buffer, cRelocationCacheVersion);
+	save<uint32_t>(buffer, static_cast<uint32_t>(cache.sections.size()));
+	for (const auto &section : cache.sections)
+	{
+		save<uint64_t>(buffer, section.first);
+		save<uint64_t>(buffer, section.second.contextHash);
+		save<uint32_t>(buffer, static_cast<uint32_t>(section.second.symbols.size()));
+		save<uint32_t>(buffer, static_cast<uint32_t>(section.second.relocations.size()));
+		save<uint32_t>(buffer, static_cast<uint32_t>(section.second.patches.size()));
+		for (uint32_t symbol : section.second.symbols)
+		{
+			save<uint32_t>(buffer, symbol);
+		}
+		for (const auto &rel : section.second.relocations)
+		{
+			save<uint32_t>(buffer, rel.offset);
+			save<uint32_t>(buffer, rel.addend);
+			save<uint32_t>(buffer, rel.symbol);
+			save<uint16_t>(buffer, rel.targetSection);
+			save<uint8_t>(buffer, rel.type);
+			save<uint8_t>(buffer, rel.resolvedEarly ? 1 : 0);
+		}
+		for (const auto &patch : section.second.patches)
+		{
+			save<uint32_t>(buffer, static_cast<uint32_t>(patch.offset));
+			save<uint32_t>(buffer, patch.value);
+		}
+	}
+
+	std::ofstream outputStream(filename, std::ios::binary);
+	outputStream.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+	return static_cast<bool>(outputStream);
+}
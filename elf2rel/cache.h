@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+const uint64_t cFnvOffsetBasis = 14695981039346656037ull;
+
+// FNV-1a, continuing from hash
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = cFnvOffsetBasis);
+
+// Relocation of a section after resolution, R_PPC_NONE entries are left out
+struct CachedRelocation
+{
+	uint32_t offset;
+	uint32_t addend; // from the start of the REL section for targets in the module, the ELF addend otherwise
+	uint32_t symbol;
+	uint16_t targetSection; // input section after folding and merging, 0 if resolved by the symbol map
+	uint8_t type;
+	bool resolvedEarly; // patched into the section data instead of left for OSLink
+};
+
+// Word of the section data replaced by a relocation resolved early
+struct CachedPatch
+{
+	int32_t offset; // from the start of the REL
+	uint32_t value;
+};
+
+// Resolved relocations of one section. The result depends on the relocation
+// entries, the section data, the symbols they refer to and where those
+// symbols were placed; the key covers the first two and contextHash the rest.
+struct CachedSection
+{
+	uint64_t contextHash;
+	std::vector<uint32_t> symbols; // sorted
+	std::vector<CachedRelocation> relocations;
+	std::vector<CachedPatch> patches;
+};
+
+// Resolved relocation sections, keyed by a hash of the relocation and
+// section data
+struct RelocationCache
+{
+	std::map<uint64_t, CachedSection> sections;
+};
+
+// A missing or invalid file leaves the cache empty
+void loadRelocationCache(const std::string &filename, RelocationCache &cache);
+bool writeRelocationCache(const std::string &filename, const RelocationCache &cache);
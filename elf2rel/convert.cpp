@@ -0,0 +1,1695 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright 2019 Linus S. (aka PistonMiner)
+
+#include "convert.h"
+
+#include "cache.h"
+#include "elf2rel.h"
+#include "exports.h"
+#include "lazy.h"
+#include "memstats.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <limits>
+#include <memory_resource>
+#include <numeric>
+#include <tuple>
+#include <unordered_map>
+
+void writeModuleHeader(std::vector<uint8_t> &buffer,
+					   int version,
+					   int id,
+					   int sectionCount,
+					   int sectionInfoOffset,
+					   int totalBssSize,
+					   int relocationOffset,
+					   int importInfoOffset,
+					   int importInfoSize,
+					   int prologSection,
+					   int epilogSection,
+					   int unresolvedSection,
+					   int prologOffset,
+					   int epilogOffset,
+					   int unresolvedOffset,
+					   int maxAlign,
+					   int maxBssAlign,
+					   int fixedDataSize)
+{
+	save<uint32_t>(buffer, id);
+	save<uint32_t>(buffer, 0); // prev link
+	save<uint32_t>(buffer, 0); // next link
+	save<uint32_t>(buffer, sectionCount);
+	save<uint32_t>(buffer, sectionInfoOffset);
+	save<uint32_t>(buffer, 0); // name offset
+	save<uint32_t>(buffer, 0); // name size
+	save<uint32_t>(buffer, version); // version
+
+	save<uint32_t>(buffer, totalBssSize);
+	save<uint32_t>(buffer, relocationOffset);
+	save<uint32_t>(buffer, importInfoOffset);
+	save<uint32_t>(buffer, importInfoSize);
+	save<uint8_t>(buffer, prologSection);
+	save<uint8_t>(buffer, epilogSection);
+	save<uint8_t>(buffer, unresolvedSection);
+	save<uint8_t>(buffer, 0); // pad
+	save<uint32_t>(buffer, prologOffset);
+	save<uint32_t>(buffer, epilogOffset);
+	save<uint32_t>(buffer, unresolvedOffset);
+	if (version >= 2)
+	{
+		save<uint32_t>(buffer, maxAlign);
+		save<uint32_t>(buffer, maxBssAlign);
+	}
+	if (version >= 3)
+	{
+		save<uint32_t>(buffer, fixedDataSize);
+	}
+}
+
+void writeSectionInfo(std::vector<uint8_t> &buffer, int offset, int size)
+{
+	save<uint32_t>(buffer, offset);
+	save<uint32_t>(buffer, size);
+}
+
+void writeImportInfo(std::vector<uint8_t> &buffer, int id, int offset)
+{
+	save<uint32_t>(buffer, id);
+	save<uint32_t>(buffer, offset);
+}
+
+void writeRelocation(std::vector<uint8_t> &buffer, int offset, int type, int section, uint32_t addend)
+{
+	save<uint16_t>(buffer, offset);
+	save<uint8_t>(buffer, type);
+	save<uint8_t>(buffer, section);
+	save<uint32_t>(buffer, addend);
+}
+
+bool loadModule(RelModule &module, const std::string &elfFilename)
+{
+	TraceScope trace("Load ELF", elfFilename);
+	MemoryPhaseScope memoryPhase(MemoryPhase::ElfLoad);
+
+	// Load input file
+	ELFIO::elfio &inputElf = module.inputElf;
+	if (!inputElf.load(elfFilename))
+	{
+		return false;
+	}
+	module.elfFilename = elfFilename;
+
+	// Find special sections
+	for (const auto &section : inputElf.sections)
+	{
+		if (section->get_type() == SHT_SYMTAB)
+		{
+			module.symSection = section;
+		}
+		else if (section->get_type() == SHT_RELA)
+		{
+			module.relocationSections.emplace_back(section);
+		}
+	}
+
+	// Symbol accessor
+	module.symbols = std::make_unique<ELFIO::symbol_section_accessor>(inputElf, module.symSection);
+
+	// Read all symbols once, ELFIO allocates a new name on every lookup
+	ELFIO::symbol_section_accessor &symbols = *module.symbols;
+	module.symbolTable.reserve(symbols.get_symbols_num());
+	for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i)
+	{
+		std::string name;
+		ModuleSymbol symbol = {};
+		unsigned char other;
+		if (!symbols.get_symbol(i, name, symbol.value, symbol.size, symbol.bind, symbol.type, symbol.sectionIndex, other))
+		{
+			break;
+		}
+		symbol.name = module.arena.intern(name);
+		module.symbolTable.push_back(symbol);
+	}
+
+	module.keptSections = findKeptSections(inputElf, createSectionMatcher(module.options.keepSectionPatterns));
+	module.sectionPlacements.assign(inputElf.sections.size(), SectionPlacement());
+	return true;
+}
+
+void redirectToDolCopies(RelModule &module, const std::vector<const SymbolMap *> &symbolMaps)
+{
+	TraceScope trace("Redirect to dol copies", module.elfFilename);
+	ELFIO::elfio &inputElf = module.inputElf;
+	const ConversionOptions &options = module.options;
+	auto isDefined = [](const ModuleSymbol &symbol)
+	{
+		return !symbol.name.empty()
+			&& symbol.type != STT_SECTION
+			&& symbol.sectionIndex != SHN_UNDEF
+			&& symbol.sectionIndex < SHN_LORESERVE;
+	};
+	auto isInDol = [&](std::string_view name)
+	{
+		for (const SymbolMap *symbolMap : symbolMaps)
+		{
+			auto it = symbolMap->find(name);
+			if (it == symbolMap->end() || it->second.moduleId != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	module.dolCopies.assign(module.symbolTable.size(), false);
+	std::vector<bool> droppedSections(inputElf.sections.size());
+	for (size_t i = 0; i < module.symbolTable.size(); ++i)
+	{
+		const ModuleSymbol &symbol = module.symbolTable[i];
+		bool listed = std::find(options.dedupSymbols.begin(), options.dedupSymbols.end(), symbol.name) != options.dedupSymbols.end();
+		if (isDefined(symbol)
+			&& (listed || (options.dedupWeakSymbols && symbol.bind == STB_WEAK))
+			&& isInDol(symbol.name))
+		{
+			module.dolCopies[i] = true;
+			droppedSections[symbol.sectionIndex] = true;
+		}
+	}
+
+	// Sections that define other symbols or are referred to by other
+	// sections through a symbol that was not redirected are still needed
+	for (size_t i = 0; i < module.symbolTable.size(); ++i)
+	{
+		const ModuleSymbol &symbol = module.symbolTable[i];
+		if (!module.dolCopies[i] && isDefined(symbol) && (symbol.bind == STB_GLOBAL || symbol.bind == STB_WEAK))
+		{
+			droppedSections[symbol.sectionIndex] = false;
+		}
+	}
+	for (const auto &section : module.relocationSections)
+	{
+		ELFIO::Elf_Word relocatedSectionIndex = section->get_info();
+		if (!module.keptSections[relocatedSectionIndex])
+		{
+			continue;
+		}
+		ELFIO::relocation_section_accessor relocations(inputElf, section);
+		for (ELFIO::Elf_Xword i = 0; i < relocations.get_entries_num(); ++i)
+		{
+			ELFIO::Elf64_Addr offset = 0;
+			ELFIO::Elf_Word symbol = 0;
+			ELFIO::Elf_Word type = 0;
+			ELFIO::Elf_Sxword addend = 0;
+			relocations.get_entry(i, offset, symbol, type, addend);
+			if (symbol >= module.symbolTable.size() || module.dolCopies[symbol])
+			{
+				continue;
+			}
+			ELFIO::Elf_Half targetSection = module.symbolTable[symbol].sectionIndex;
+			if (targetSection < droppedSections.size() && targetSection != relocatedSectionIndex)
+			{
+				droppedSections[targetSection] = false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < droppedSections.size(); ++i)
+	{
+		if (droppedSections[i])
+		{
+			module.keptSections[i] = false;
+		}
+	}
+}
+
+void redirectTarget(const RelModule &module, int &sectionIndex, uint32_t &offset)
+{
+	redirectMergedTarget(module.mergedSections, sectionIndex, offset);
+	auto it = module.foldedSections.find(sectionIndex);
+	if (it != module.foldedSections.end())
+	{
+		sectionIndex = it->second;
+	}
+}
+
+const SectionPlacement *findPlacement(const RelModule &module, int sectionIndex)
+{
+	if (sectionIndex < 0
+		|| sectionIndex >= static_cast<int>(module.sectionPlacements.size())
+		|| !module.sectionPlacements[sectionIndex].placed)
+	{
+		return nullptr;
+	}
+	return &module.sectionPlacements[sectionIndex];
+}
+
+// .text.name goes to .text and .rodata.str1.4 to .rodata, sections without a
+// suffix keep their name
+static std::string getCoalescedSectionName(const std::string &name)
+{
+	return name.substr(0, name.find('.', 1));
+}
+
+// SHT_NOBITS sections and the data sections placed in bss instead
+static bool isBssSection(const RelModule &module, int sectionIndex)
+{
+	return module.inputElf.sections[sectionIndex]->get_type() == SHT_NOBITS
+		|| (!module.zeroDataSections.empty() && module.zeroDataSections[sectionIndex]);
+}
+
+static bool isSectionReplaced(const RelModule &module, int sectionIndex)
+{
+	auto it = module.mergedSections.find(sectionIndex);
+	return module.foldedSections.count(sectionIndex)
+		|| (it != module.mergedSections.end() && it->second.outputSection != sectionIndex);
+}
+
+void layoutModule(RelModule &module)
+{
+	ELFIO::elfio &inputElf = module.inputElf;
+	ELFIO::symbol_section_accessor &symbols = *module.symbols;
+	TraceScope trace("Layout sections", module.elfFilename);
+	MemoryPhaseScope memoryPhase(MemoryPhase::Layout);
+
+	// Merge constants, then fold identical function sections
+	if (module.options.mergeConstants)
+	{
+		TraceScope passTrace("Merge constants");
+		module.mergedSections = mergeConstantSections(inputElf, module.keptSections, module.relocationSections);
+	}
+	if (module.options.foldIdentical)
+	{
+		TraceScope passTrace("Fold identical sections");
+		module.foldedSections = foldIdenticalSections(inputElf, module.keptSections, symbols, module.relocationSections, module.mergedSections);
+	}
+	if (module.options.zeroDataToBss)
+	{
+		TraceScope passTrace("Find zero data sections");
+		module.zeroDataSections = findZeroDataSections(inputElf, module.keptSections, module.relocationSections);
+	}
+	// Find prolog, epilog and unresolved
+	auto findSymbolSectionAndOffset = [&](std::string_view name, int &sectionIndex, int &offset)
+	{
+		for (const auto &symbol : module.symbolTable)
+		{
+			if (symbol.name == name)
+			{
+				sectionIndex = static_cast<int>(symbol.sectionIndex);
+				uint32_t targetOffset = static_cast<uint32_t>(symbol.value);
+				redirectTarget(module, sectionIndex, targetOffset);
+				offset = static_cast<int>(targetOffset);
+				break;
+			}
+		}
+	};
+
+	findSymbolSectionAndOffset("_prolog", module.prologSectionIndex, module.prologOffset);
+	findSymbolSectionAndOffset("_epilog", module.epilogSectionIndex, module.epilogOffset);
+	findSymbolSectionAndOffset("_unresolved", module.unresolvedSectionIndex, module.unresolvedOffset);
+
+	// Assign the sections to REL sections. Each input section is its own REL
+	// section unless they are coalesced, removed ones keep an empty entry.
+	std::vector<RelSection> &relSections = module.relSections;
+	std::vector<std::vector<int>> relSectionMembers;
+	std::map<std::tuple<std::string, bool, bool, bool>, int> coalescedSections;
+	SectionMatcher initMatcher;
+	for (const auto &pattern : module.options.initSectionPatterns)
+	{
+		initMatcher.addPattern(pattern);
+	}
+	auto isInitSection = [&](ELFIO::section *section)
+	{
+		return !isBssSection(module, section->get_index()) && initMatcher.matches(section->get_name());
+	};
+	if (module.options.coalesceSections)
+	{
+		// Section 0 stays empty like the ELF null section
+		relSections.emplace_back();
+		relSectionMembers.emplace_back();
+	}
+	for (const auto &section : inputElf.sections)
+	{
+		int sectionIndex = section->get_index();
+		// Should keep? Folded and merged sections are replaced by another section
+		bool placed = module.keptSections[sectionIndex] && !isSectionReplaced(module, sectionIndex);
+		if (!module.options.coalesceSections)
+		{
+			relSections.push_back({ section->get_name() });
+			relSectionMembers.emplace_back();
+			if (placed)
+			{
+				relSections.back().init = isInitSection(section);
+				relSectionMembers.back().push_back(sectionIndex);
+			}
+			continue;
+		}
+		if (!placed)
+		{
+			continue;
+		}
+
+		bool bss = isBssSection(module, sectionIndex);
+		bool exec = (section->get_flags() & SHF_EXECINSTR) != 0;
+		bool init = isInitSection(section);
+		std::string name = bss && section->get_type() != SHT_NOBITS ? ".bss" : getCoalescedSectionName(section->get_name()) + (init ? ".init" : "");
+		auto it = coalescedSections.emplace(std::make_tuple(name, bss, exec, init), static_cast<int>(relSections.size()));
+		if (it.second)
+		{
+			relSections.push_back({ name });
+			relSections.back().init = init;
+			relSectionMembers.emplace_back();
+		}
+		relSectionMembers[it.first->second].push_back(sectionIndex);
+	}
+	// Lazy import stubs get a REL section of their own, linkModule places it
+	// after the section data
+	if (module.options.lazyImports)
+	{
+		module.stubTable.relSection = static_cast<int>(relSections.size());
+		relSections.push_back({ ".elf2rel.stubs", false, true });
+		relSectionMembers.emplace_back();
+	}
+	// The export table is the last REL section, where the lookup finds it
+	if (!module.options.exportTableSymbols.empty())
+	{
+		module.exportTable.relSection = static_cast<int>(relSections.size());
+		relSections.push_back({ ".elf2rel.exports" });
+		relSectionMembers.emplace_back();
+	}
+
+	std::vector<uint8_t> &headerBuffer = module.headerBuffer;
+	// Dummy values for header until offsets are determined
+	writeModuleHeader(headerBuffer, module.options.relVersion, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	module.sectionInfoOffset = headerBuffer.size();
+	for (size_t i = 0; i < relSections.size(); ++i)
+	{
+		writeSectionInfo(headerBuffer, 0, 0);
+	}
+
+	// Sections of the functions in the symbol ordering go first, in the
+	// order of the list
+	std::vector<int> sectionRanks(inputElf.sections.size(), std::numeric_limits<int>::max());
+	if (!module.options.symbolOrdering.empty())
+	{
+		std::unordered_map<std::string_view, const ModuleSymbol *> definedSymbols;
+		for (const auto &symbol : module.symbolTable)
+		{
+			if (!symbol.name.empty() && symbol.sectionIndex != SHN_UNDEF && symbol.sectionIndex < SHN_LORESERVE)
+			{
+				definedSymbols.emplace(symbol.name, &symbol);
+			}
+		}
+		int rank = 0;
+		for (const auto &name : module.options.symbolOrdering)
+		{
+			auto it = definedSymbols.find(name);
+			if (it == definedSymbols.end())
+			{
+				continue;
+			}
+			int sectionIndex = it->second->sectionIndex;
+			uint32_t offset = static_cast<uint32_t>(it->second->value);
+			redirectTarget(module, sectionIndex, offset);
+			if (inputElf.sections[sectionIndex]->get_flags() & SHF_EXECINSTR)
+			{
+				sectionRanks[sectionIndex] = std::min(sectionRanks[sectionIndex], rank++);
+			}
+		}
+	}
+	auto getRank = [&](size_t relSectionIndex)
+	{
+		const std::vector<int> &members = relSectionMembers[relSectionIndex];
+		return members.empty() ? std::numeric_limits<int>::max() : sectionRanks[members.front()];
+	};
+	for (auto &members : relSectionMembers)
+	{
+		std::stable_sort(members.begin(), members.end(), [&](int left, int right)
+		{
+			return sectionRanks[left] < sectionRanks[right];
+		});
+	}
+	std::vector<size_t> placementOrder(relSections.size());
+	std::iota(placementOrder.begin(), placementOrder.end(), 0);
+	std::stable_sort(placementOrder.begin(), placementOrder.end(), [&](size_t left, size_t right)
+	{
+		return getRank(left) < getRank(right);
+	});
+	// Init sections go last so the memory can be freed after _prolog
+	std::stable_partition(placementOrder.begin(), placementOrder.end(), [&](size_t relSectionIndex)
+	{
+		return !relSections[relSectionIndex].init;
+	});
+
+	// Place sections, their data is only copied when the REL is written
+	std::vector<uint8_t> sectionInfoBuffer;
+	int dataEnd = static_cast<int>(headerBuffer.size());
+	std::vector<SectionPlacement> &sectionPlacements = module.sectionPlacements;
+	int &totalBssSize = module.totalBssSize;
+	int &maxAlign = module.maxAlign;
+	int &maxBssAlign = module.maxBssAlign;
+	// The export table follows the resident section data, symbols in init
+	// sections are not placed yet and cannot be exported
+	auto placeExportTable = [&]()
+	{
+		std::vector<std::pair<std::string, SymbolLocation>> exportedSymbols = getExportedSymbols(module);
+		std::unordered_map<std::string_view, const SymbolLocation *> exportedLocations;
+		for (const auto &symbol : exportedSymbols)
+		{
+			exportedLocations.emplace(symbol.first, &symbol.second);
+		}
+
+		std::vector<std::pair<std::string, SymbolLocation>> tableSymbols;
+		std::map<uint32_t, std::string_view> hashes;
+		for (const auto &name : module.options.exportTableSymbols)
+		{
+			auto it = exportedLocations.find(name);
+			if (it == exportedLocations.end())
+			{
+				printf("Export table symbol '%s' is not a global symbol of a kept section\n", name.c_str());
+				continue;
+			}
+			auto hashIt = hashes.emplace(hashExportName(name), name);
+			if (!hashIt.second)
+			{
+				if (hashIt.first->second == name)
+				{
+					continue;
+				}
+				if (module.options.exportTableHashesOnly)
+				{
+					printf("Export table symbols '%s' and '%s' have the same hash, lookups of either may return the other\n",
+						   hashIt.first->second.data(), name.c_str());
+				}
+			}
+			tableSymbols.emplace_back(name, *it->second);
+		}
+
+		RelSection &exportSection = relSections[module.exportTable.relSection];
+		module.exportTable.offset = (dataEnd + 3) & ~3;
+		module.exportTable.data = buildExportTable(tableSymbols, !module.options.exportTableHashesOnly);
+		exportSection.offset = module.exportTable.offset;
+		exportSection.size = static_cast<int>(module.exportTable.data.size());
+		dataEnd = exportSection.offset + exportSection.size;
+		maxAlign = std::max(maxAlign, 4);
+	};
+
+	int lastBssSection = -1;
+	bool exportTablePlaced = module.exportTable.relSection == -1;
+	int initOffset = -1;
+	for (size_t relSectionIndex : placementOrder)
+	{
+		RelSection &relSection = relSections[relSectionIndex];
+		if (relSection.init && !exportTablePlaced)
+		{
+			placeExportTable();
+			exportTablePlaced = true;
+		}
+		for (int sectionIndex : relSectionMembers[relSectionIndex])
+		{
+			ELFIO::section *section = inputElf.sections[sectionIndex];
+			SectionPlacement &placement = sectionPlacements[sectionIndex];
+			placement.placed = true;
+			placement.relSection = static_cast<int>(relSectionIndex);
+			placement.size = static_cast<int>(section->get_size());
+
+			// BSS?
+			if (isBssSection(module, sectionIndex))
+			{
+				// Update max alignment
+				int align = static_cast<int>(section->get_addr_align());
+				maxBssAlign = std::max(maxBssAlign, align);
+
+				// OSLink packs bss sections without alignment, so the first
+				// member of a section pads the previous bss section and the
+				// others pad their own section
+				if (align > 1)
+				{
+					int padding = ((totalBssSize + relSection.size + align - 1) & ~(align - 1)) - totalBssSize - relSection.size;
+					if (relSection.size == 0 && lastBssSection != -1)
+					{
+						relSections[lastBssSection].size += padding;
+						totalBssSize += padding;
+					}
+					else
+					{
+						relSection.size += padding;
+					}
+				}
+				if (relSection.size == 0)
+				{
+					relSection.bss = true;
+					relSection.offset = totalBssSize;
+				}
+
+				placement.bss = true;
+				placement.relOffset = relSection.size;
+				placement.offset = relSection.offset + placement.relOffset;
+				placement.align = align;
+				relSection.size += placement.size;
+			}
+			else
+			{
+				// Update max alignment (minimum 2, low offset bit is used for exec flag)
+				int align = std::max(static_cast<int>(section->get_addr_align()), 2);
+				if (sectionRanks[sectionIndex] != std::numeric_limits<int>::max())
+				{
+					align = std::max(align, module.options.orderedSectionAlign);
+				}
+				maxAlign = std::max(maxAlign, align);
+
+				int requiredPadding = ((dataEnd + align - 1) & ~(align - 1)) - dataEnd;
+				int offset = dataEnd + requiredPadding;
+				dataEnd = offset + placement.size;
+
+				bool exec = (section->get_flags() & SHF_EXECINSTR) != 0;
+				if (sectionIndex == relSectionMembers[relSectionIndex].front())
+				{
+					relSection.offset = offset;
+					relSection.exec = exec;
+				}
+				placement.exec = exec;
+				placement.offset = offset;
+				placement.relOffset = offset - relSection.offset;
+				placement.align = align;
+				placement.padding = requiredPadding;
+				relSection.size = dataEnd - relSection.offset;
+				auto mergedIt = module.mergedSections.find(sectionIndex);
+				placement.modified = mergedIt != module.mergedSections.end()
+									 && mergedIt->second.outputSection == sectionIndex;
+			}
+		}
+
+		if (relSection.bss)
+		{
+			totalBssSize += relSection.size;
+			lastBssSection = static_cast<int>(relSectionIndex);
+		}
+		if (relSection.init && initOffset == -1)
+		{
+			initOffset = relSection.offset;
+		}
+	}
+	if (!exportTablePlaced)
+	{
+		placeExportTable();
+	}
+
+	// Sections that were not placed keep their index so relocations against
+	// them still point to an empty section
+	if (!module.options.coalesceSections)
+	{
+		for (size_t i = 0; i < sectionPlacements.size(); ++i)
+		{
+			sectionPlacements[i].relSection = static_cast<int>(i);
+		}
+	}
+
+	// Fill in section info in main buffer
+	for (const auto &relSection : relSections)
+	{
+		if (relSection.bss || relSection.offset == 0)
+		{
+			writeSectionInfo(sectionInfoBuffer, 0, relSection.size);
+		}
+		else
+		{
+			// Mark executable sections
+			writeSectionInfo(sectionInfoBuffer, relSection.offset | (relSection.exec ? 1 : 0), relSection.size);
+		}
+	}
+	std::copy(sectionInfoBuffer.begin(), sectionInfoBuffer.end(), headerBuffer.begin() + module.sectionInfoOffset);
+	module.dataEnd = dataEnd;
+	module.initOffset = initOffset == -1 ? dataEnd : initOffset;
+	module.tableOffset = dataEnd;
+
+	// prolog, epilog and unresolved are given in REL sections
+	for (auto target : { std::make_pair(&module.prologSectionIndex, &module.prologOffset),
+						 std::make_pair(&module.epilogSectionIndex, &module.epilogOffset),
+						 std::make_pair(&module.unresolvedSectionIndex, &module.unresolvedOffset) })
+	{
+		if (const SectionPlacement *placement = findPlacement(module, *target.first))
+		{
+			*target.first = placement->relSection;
+			*target.second += placement->relOffset;
+		}
+	}
+	for (int sectionIndex : { module.epilogSectionIndex, module.unresolvedSectionIndex })
+	{
+		if (relSections[sectionIndex].init)
+		{
+			printf("Init section '%s' also holds _epilog or _unresolved, which are needed after it is freed\n",
+				   relSections[sectionIndex].name.c_str());
+		}
+	}
+}
+
+int getRelocationModuleDelay(uint32_t targetModuleID, uint32_t moduleID)
+{
+	if (targetModuleID == 0 || targetModuleID == moduleID)
+	{
+		return 1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+bool isRelocationBefore(const Relocation &left, const Relocation &right, uint32_t moduleID)
+{
+	// Relocations against the dol & this module need to be placed last for trimming with OSLinkFixed
+	int delayLeft = getRelocationModuleDelay(left.moduleID, moduleID);
+	int delayRight = getRelocationModuleDelay(right.moduleID, moduleID);
+	if (delayLeft != delayRight)
+	{
+		return delayLeft < delayRight;
+	}
+
+	return std::tuple<uint32_t, uint32_t, uint32_t>(left.moduleID, left.section, left.offset)
+		   < std::tuple<uint32_t, uint32_t, uint32_t>(right.moduleID, right.section, right.offset);
+}
+
+uint32_t resolveEarlyRelocation(uint32_t data, int type, int delta)
+{
+	if (type == R_PPC_REL24)
+	{
+		data |= (delta & 0x03FFFFFC);
+	}
+	else if (type == R_PPC_REL32)
+	{
+		data = delta;
+	}
+	return data;
+}
+
+// Relocations store REL section indices in a byte
+static bool checkRelSectionIndex(const RelModule &module, int sectionIndex)
+{
+	if (module.sectionPlacements[sectionIndex].relSection > 255)
+	{
+		printf("Relocation against section '%s', which would be REL section %d but relocations can only refer to sections up to 255 (try --coalesce-sections)\n",
+			   module.relSections[module.sectionPlacements[sectionIndex].relSection].name.c_str(),
+			   module.sectionPlacements[sectionIndex].relSection);
+		return false;
+	}
+	return true;
+}
+
+bool resolveEarly(RelModule &module, const Relocation &rel)
+{
+	if (rel.moduleID != static_cast<uint32_t>(module.options.moduleID)
+		|| !((rel.type == R_PPC_REL24 && module.options.resolveEarly) || rel.type == R_PPC_REL32))
+	{
+		return false;
+	}
+
+	int offset = module.sectionPlacements[rel.section].offset + rel.offset;
+	int delta = module.relSections[rel.targetSection].offset + rel.addend - offset;
+	const char *sectionData = module.inputElf.sections[rel.section]->get_data();
+	std::vector<uint8_t> instructionBuffer(sectionData + rel.offset, sectionData + rel.offset + 4);
+	uint32_t data;
+	load(instructionBuffer, data);
+	module.patches.push_back({ offset, resolveEarlyRelocation(data, rel.type, delta) });
+	return true;
+}
+
+// Finds the register that reaches a dol address with a 16 bit offset, r13
+// holds _SDA_BASE_ and r2 holds _SDA2_BASE_ from the symbol map
+static bool findSmallDataBase(const SymbolMap &externalSymbolMap,
+							  uint32_t address,
+							  bool allowSda2,
+							  uint32_t &base,
+							  uint32_t &baseRegister)
+{
+	for (auto candidate : { std::make_pair(std::string_view("_SDA_BASE_"), 13u),
+							std::make_pair(std::string_view("_SDA2_BASE_"), 2u) })
+	{
+		if (candidate.second == 2 && !allowSda2)
+		{
+			break;
+		}
+		auto it = externalSymbolMap.find(candidate.first);
+		if (it == externalSymbolMap.end() || it->second.moduleId != 0)
+		{
+			continue;
+		}
+		int32_t delta = static_cast<int32_t>(address - it->second.addr);
+		if (delta >= -0x8000 && delta < 0x8000)
+		{
+			base = it->second.addr;
+			baseRegister = candidate.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Instruction containing a 16 bit field, relocations may point at either
+static uint32_t loadInstruction(const RelModule &module, uint32_t sectionIndex, uint32_t offset)
+{
+	const char *sectionData = module.inputElf.sections[sectionIndex]->get_data();
+	std::vector<uint8_t> instructionBuffer(sectionData + (offset & ~3u), sectionData + (offset & ~3u) + 4);
+	uint32_t data;
+	load(instructionBuffer, data);
+	return data;
+}
+
+static void patchInstruction(RelModule &module, uint32_t sectionIndex, uint32_t offset, uint32_t data)
+{
+	module.patches.push_back({ module.sectionPlacements[sectionIndex].offset + static_cast<int>(offset & ~3u), data });
+}
+
+// Resolves a small data relocation against the dol, so module code can reach
+// the dol's small data with a single instruction
+static bool resolveSmallData(RelModule &module, const Relocation &rel, const SymbolMap &externalSymbolMap, std::string_view symbolName)
+{
+	if (rel.moduleID != 0)
+	{
+		printf("Small data relocation against '%s' in module %u, only dol symbols can be reached through r13 and r2\n",
+			   symbolName.data(),
+			   rel.moduleID);
+		return false;
+	}
+
+	// R_PPC_SDAREL16 is always relative to r13, R_PPC_EMB_SDA21 also selects
+	// the base register in the rA field
+	uint32_t base = 0;
+	uint32_t baseRegister = 0;
+	if (!findSmallDataBase(externalSymbolMap, rel.addend, rel.type == R_PPC_EMB_SDA21, base, baseRegister))
+	{
+		printf("Symbol '%s' is not within 32 KB of %s from the symbol map\n",
+			   symbolName.data(),
+			   rel.type == R_PPC_SDAREL16 ? "_SDA_BASE_" : "_SDA_BASE_ or _SDA2_BASE_");
+		return false;
+	}
+
+	uint32_t data = loadInstruction(module, rel.section, rel.offset);
+	data = (data & 0xFFFF0000) | ((rel.addend - base) & 0xFFFF);
+	if (rel.type == R_PPC_EMB_SDA21)
+	{
+		data = (data & ~0x001F0000u) | (baseRegister << 16);
+	}
+	patchInstruction(module, rel.section, rel.offset, data);
+	return true;
+}
+
+// Rewrites lis rX,sym@ha followed by addi rX,rX,sym@l, or by a load of rX
+// from sym@l(rX), into a nop and a single access relative to r13 or r2 when
+// sym is dol small data. Relaxed relocations are turned into R_PPC_NONE.
+static void relaxSmallDataAccesses(RelModule &module, std::pmr::deque<Relocation> &relocations, const SymbolMap &externalSymbolMap)
+{
+	std::map<std::pair<uint32_t, uint32_t>, Relocation *> highAdjusted;
+	for (auto &rel : relocations)
+	{
+		if (rel.moduleID == 0 && rel.type == R_PPC_ADDR16_HA)
+		{
+			highAdjusted[{ rel.section, rel.offset & ~3u }] = &rel;
+		}
+	}
+
+	for (auto &low : relocations)
+	{
+		if (low.moduleID != 0 || low.type != R_PPC_ADDR16_LO || (low.offset & ~3u) < 4)
+		{
+			continue;
+		}
+		auto it = highAdjusted.find({ low.section, (low.offset & ~3u) - 4 });
+		if (it == highAdjusted.end() || it->second->type != R_PPC_ADDR16_HA || it->second->addend != low.addend)
+		{
+			continue;
+		}
+		Relocation &high = *it->second;
+		uint32_t base = 0;
+		uint32_t baseRegister = 0;
+		if (!findSmallDataBase(externalSymbolMap, low.addend, true, base, baseRegister))
+		{
+			continue;
+		}
+
+		// lis is addis rX,0. The second instruction has to read and overwrite
+		// rX so nothing else can use the upper half.
+		uint32_t lis = loadInstruction(module, high.section, high.offset);
+		uint32_t access = loadInstruction(module, low.section, low.offset);
+		uint32_t reg = (lis >> 21) & 31;
+		uint32_t opcode = access >> 26;
+		bool isAddiOrLoad = opcode == 14 // addi
+			|| opcode == 32 // lwz
+			|| opcode == 34 // lbz
+			|| opcode == 40 // lhz
+			|| opcode == 42; // lha
+		if ((lis >> 26) != 15 || ((lis >> 16) & 31) != 0 || reg == 0
+			|| !isAddiOrLoad || ((access >> 21) & 31) != reg || ((access >> 16) & 31) != reg)
+		{
+			continue;
+		}
+
+		patchInstruction(module, high.section, high.offset, 0x60000000); // nop
+		patchInstruction(module, low.section, low.offset,
+						 (access & 0xFFE00000) | (baseRegister << 16) | ((low.addend - base) & 0xFFFF));
+		high.type = R_PPC_NONE;
+		low.type = R_PPC_NONE;
+		module.report.relaxed++;
+	}
+
+	relocations.erase(std::remove_if(relocations.begin(), relocations.end(), [](const Relocation &rel)
+	{
+		return rel.type == R_PPC_NONE;
+	}), relocations.end());
+}
+
+// Reads the relocations of a section, looks up their symbols and resolves
+// those within the module. Relocations resolved early are added to the
+// module's patches.
+static bool resolveSectionRelocations(RelModule &module, ELFIO::section *section, std::vector<CachedRelocation> &resolved)
+{
+	const std::vector<SectionPlacement> &sectionPlacements = module.sectionPlacements;
+	int relocatedSectionIndex = section->get_info();
+	ELFIO::relocation_section_accessor relocations(module.inputElf, section);
+	resolved.reserve(relocations.get_entries_num());
+	for (ELFIO::Elf_Xword i = 0; i < relocations.get_entries_num(); ++i)
+	{
+		ELFIO::Elf64_Addr offset = 0;
+		ELFIO::Elf_Word symbol = 0;
+		ELFIO::Elf_Word type = 0;
+		ELFIO::Elf_Sxword addend = 0;
+		relocations.get_entry(i, offset, symbol, type, addend);
+
+		// Ignore R_PPC_NONE
+		if (type == R_PPC_NONE)
+			continue;
+
+		if (symbol >= module.symbolTable.size())
+		{
+			printf("Unable to find symbol %u in symbol table!\n", static_cast<uint32_t>(symbol));
+			return false;
+		}
+		const ModuleSymbol &target = module.symbolTable[symbol];
+
+		CachedRelocation entry;
+		entry.offset = static_cast<uint32_t>(offset);
+		entry.symbol = symbol;
+		entry.type = static_cast<uint8_t>(type);
+		entry.addend = static_cast<uint32_t>(addend);
+		entry.targetSection = 0;
+		entry.resolvedEarly = false;
+		// Resolved against the symbol map when linking if the dol's copy is
+		// used instead
+		bool dolCopy = !module.dolCopies.empty() && module.dolCopies[symbol];
+		if (target.sectionIndex && !dolCopy)
+		{
+			// r13 and r2 point at the dol's small data, not at the module's
+			if (type == R_PPC_SDAREL16 || type == R_PPC_EMB_SDA21)
+			{
+				printf("Small data relocation against '%s' in this module, only dol symbols can be reached through r13 and r2, build the module's data without small data (-G0)\n",
+					   target.name.data());
+				return false;
+			}
+
+			// Self-relocation
+			int targetSectionIndex = target.sectionIndex;
+			uint32_t targetOffset = static_cast<uint32_t>(addend + target.value);
+			redirectTarget(module, targetSectionIndex, targetOffset);
+
+			const SectionPlacement &placement = sectionPlacements[targetSectionIndex];
+			if (!checkRelSectionIndex(module, targetSectionIndex))
+			{
+				return false;
+			}
+
+			Relocation rel;
+			rel.moduleID = module.options.moduleID;
+			rel.section = relocatedSectionIndex;
+			rel.offset = entry.offset;
+			rel.targetSection = placement.relSection;
+			rel.addend = targetOffset + placement.relOffset;
+			rel.type = entry.type;
+			entry.targetSection = static_cast<uint16_t>(targetSectionIndex);
+			entry.addend = rel.addend;
+			// Relocations against unwritten sections are kept and warned about
+			entry.resolvedEarly = placement.placed && resolveEarly(module, rel);
+		}
+		resolved.push_back(entry);
+	}
+	return true;
+}
+
+// Adds a resolved relocation of a section to the module
+static void addResolvedRelocation(RelModule &module, int relocatedSectionIndex, const CachedRelocation &entry)
+{
+	RelocationReport &report = module.collectionReport;
+	std::string_view symbolName = module.symbolTable[entry.symbol].name;
+
+	Relocation rel;
+	rel.section = relocatedSectionIndex;
+	rel.offset = entry.offset;
+	rel.type = entry.type;
+	rel.addend = entry.addend;
+	if (entry.targetSection)
+	{
+		const SectionPlacement &placement = module.sectionPlacements[entry.targetSection];
+		if (!placement.placed && !isBssSection(module, entry.targetSection))
+		{
+			printf("Relocation from section '%s' offset %x against symbol '%s' in unwritten section '%s'\n",
+				   module.inputElf.sections[relocatedSectionIndex]->get_name().c_str(),
+				   entry.offset,
+				   symbolName.data(),
+				   module.inputElf.sections[entry.targetSection]->get_name().c_str());
+		}
+
+		rel.moduleID = module.options.moduleID;
+		rel.targetSection = placement.relSection;
+		if (entry.resolvedEarly)
+		{
+			report.earlyResolved++;
+		}
+		else
+		{
+			module.internalRelocations.emplace_back(rel);
+		}
+
+		// Section symbols are attributed to their section
+		if (symbolName.empty())
+		{
+			symbolName = module.arena.intern(module.inputElf.sections[entry.targetSection]->get_name());
+		}
+	}
+	else
+	{
+		// Resolved against the symbol map when linking
+		rel.moduleID = 0;
+		rel.targetSection = 0;
+		module.externalRelocations.push_back({ rel, symbolName });
+	}
+
+	auto fanInIt = report.symbolFanIn.find(symbolName);
+	if (fanInIt == report.symbolFanIn.end())
+	{
+		fanInIt = report.symbolFanIn.emplace(symbolName, 0).first;
+	}
+	fanInIt->second++;
+}
+
+// Hash of everything the resolved relocations of a section depend on besides
+// its relocation entries and data: the symbols they refer to, where the
+// sections of those symbols ended up and where the section itself was placed.
+// Returns false if a symbol is not in the module.
+static bool hashSectionContext(const RelModule &module, int relocatedSectionIndex,
+							   const std::vector<uint32_t> &symbols, uint64_t &hash)
+{
+	const std::vector<SectionPlacement> &sectionPlacements = module.sectionPlacements;
+	hash = cFnvOffsetBasis;
+	uint64_t values[] = { static_cast<uint64_t>(module.options.moduleID),
+						  module.options.resolveEarly,
+						  static_cast<uint64_t>(sectionPlacements[relocatedSectionIndex].offset) };
+	hash = hashBytes(values, sizeof(values), hash);
+	for (uint32_t symbolIndex : symbols)
+	{
+		if (symbolIndex >= module.symbolTable.size())
+		{
+			return false;
+		}
+		const ModuleSymbol &symbol = module.symbolTable[symbolIndex];
+		bool dolCopy = !module.dolCopies.empty() && module.dolCopies[symbolIndex];
+		uint64_t fields[] = { symbol.value, symbol.sectionIndex, dolCopy, symbol.name.size() };
+		hash = hashBytes(fields, sizeof(fields), hash);
+		hash = hashBytes(symbol.name.data(), symbol.name.size(), hash);
+		if (!symbol.sectionIndex || dolCopy || symbol.sectionIndex >= sectionPlacements.size())
+		{
+			continue;
+		}
+
+		// Merged pieces and the section the target ends up in
+		auto mergedIt = module.mergedSections.find(symbol.sectionIndex);
+		if (mergedIt != module.mergedSections.end())
+		{
+			const std::vector<MergedPiece> &pieces = mergedIt->second.pieces;
+			hash = hashBytes(&mergedIt->second.outputSection, sizeof(int), hash);
+			hash = hashBytes(pieces.data(), pieces.size() * sizeof(MergedPiece), hash);
+		}
+		int targetSectionIndex = symbol.sectionIndex;
+		uint32_t targetOffset = 0;
+		redirectTarget(module, targetSectionIndex, targetOffset);
+		const SectionPlacement &placement = sectionPlacements[targetSectionIndex];
+		int relSectionOffset = placement.relSection < static_cast<int>(module.relSections.size())
+			? module.relSections[placement.relSection].offset
+			: 0;
+		uint64_t target[] = { static_cast<uint64_t>(targetSectionIndex),
+							  placement.placed,
+							  isBssSection(module, targetSectionIndex),
+							  static_cast<uint64_t>(placement.relSection),
+							  static_cast<uint64_t>(placement.relOffset),
+							  static_cast<uint64_t>(relSectionOffset) };
+		hash = hashBytes(target, sizeof(target), hash);
+	}
+	return true;
+}
+
+bool collectRelocations(RelModule &module)
+{
+	TraceScope trace("Collect relocations", module.elfFilename);
+	MemoryPhaseScope memoryPhase(MemoryPhase::Relocations);
+	ELFIO::elfio &inputElf = module.inputElf;
+	const std::vector<ELFIO::section *> &relocationSections = module.relocationSections;
+	const std::vector<SectionPlacement> &sectionPlacements = module.sectionPlacements;
+	RelocationReport &report = module.collectionReport;
+
+	// Resolved relocations of a section are reused from an earlier run if the
+	// section, its relocations and the symbols they refer to are unchanged.
+	// The cache is rewritten with just the sections of this run so it does
+	// not grow without bound.
+	const std::string &cacheFilename = module.options.relocationCacheFilename;
+	RelocationCache previousCache, cache;
+	if (!cacheFilename.empty())
+	{
+		TraceScope cacheTrace("Load relocation cache", cacheFilename);
+		loadRelocationCache(cacheFilename, previousCache);
+	}
+
+	// Find all relocations
+	CachedSection resolvedSection;
+	for (const auto &section : relocationSections)
+	{
+		int relocatedSectionIndex = section->get_info();
+		ELFIO::section *relocatedSection = inputElf.sections[relocatedSectionIndex];
+		// Only relocate sections that were written
+		if (sectionPlacements[relocatedSectionIndex].placed && !sectionPlacements[relocatedSectionIndex].bss)
+		{
+			// Section names are returned by value, only build them for the trace
+			TraceScope sectionTrace("Collect section relocations",
+									isTraceEnabled() ? relocatedSection->get_name() : std::string());
+			if (!checkRelSectionIndex(module, relocatedSectionIndex))
+			{
+				return false;
+			}
+
+			const CachedSection *resolved = nullptr;
+			uint64_t key = 0;
+			if (!cacheFilename.empty())
+			{
+				// Identical functions are told apart by their section name
+				const std::string &name = relocatedSection->get_name();
+				key = hashBytes(name.data(), name.size());
+				key = hashBytes(section->get_data(), section->get_size(), key);
+				key = hashBytes(relocatedSection->get_data(), relocatedSection->get_size(), key);
+				auto cached = previousCache.sections.find(key);
+				uint64_t contextHash;
+				if (cached != previousCache.sections.end()
+					&& hashSectionContext(module, relocatedSectionIndex, cached->second.symbols, contextHash)
+					&& contextHash == cached->second.contextHash)
+				{
+					resolved = &cached->second;
+					for (const auto &patch : resolved->patches)
+					{
+						module.patches.push_back({ patch.offset, patch.value });
+					}
+					report.reusedSections++;
+				}
+			}
+			if (!resolved)
+			{
+				size_t firstPatch = module.patches.size();
+				resolvedSection.relocations.clear();
+				if (!resolveSectionRelocations(module, section, resolvedSection.relocations))
+				{
+					return false;
+				}
+				resolved = &resolvedSection;
+
+				if (!cacheFilename.empty())
+				{
+					resolvedSection.patches.clear();
+					for (size_t i = firstPatch; i < module.patches.size(); ++i)
+					{
+						resolvedSection.patches.push_back({ module.patches[i].offset, module.patches[i].value });
+					}
+					resolvedSection.symbols.clear();
+					for (const auto &entry : resolvedSection.relocations)
+					{
+						resolvedSection.symbols.push_back(entry.symbol);
+					}
+					std::sort(resolvedSection.symbols.begin(), resolvedSection.symbols.end());
+					resolvedSection.symbols.erase(std::unique(resolvedSection.symbols.begin(), resolvedSection.symbols.end()),
+												  resolvedSection.symbols.end());
+					hashSectionContext(module, relocatedSectionIndex, resolvedSection.symbols, resolvedSection.contextHash);
+				}
+			}
+			if (!cacheFilename.empty())
+			{
+				cache.sections[key] = *resolved;
+				report.cachedSections++;
+			}
+
+			for (const auto &entry : resolved->relocations)
+			{
+				addResolvedRelocation(module, relocatedSectionIndex, entry);
+			}
+		}
+	}
+
+	if (!cacheFilename.empty())
+	{
+		TraceScope cacheTrace("Write relocation cache", cacheFilename);
+		if (!writeRelocationCache(cacheFilename, cache))
+		{
+			printf("Failed to write relocation cache '%s'\n", cacheFilename.c_str());
+		}
+	}
+
+	module.earlyPatchCount = module.patches.size();
+	return true;
+}
+
+// Routes calls into other modules through one stub per target function, so
+// OSLink only applies the branch to the runtime instead of every call. The
+// stub table is placed after the section data and the call sites are patched
+// to branch to their stubs.
+static bool buildLazyStubs(RelModule &module,
+						   const std::vector<Relocation> &calls,
+						   const SymbolMap &externalSymbolMap,
+						   std::vector<Relocation> &stubRelocations)
+{
+	RelSection &stubSection = module.relSections[module.stubTable.relSection];
+	module.stubTable.offset = module.dataEnd;
+	module.stubTable.data.clear();
+	stubSection.offset = 0;
+	stubSection.size = 0;
+
+	std::map<LazyImport, size_t> importIndices;
+	std::vector<LazyImport> imports;
+	for (const auto &rel : calls)
+	{
+		if (importIndices.emplace(LazyImport{ rel.moduleID, rel.targetSection, rel.addend }, imports.size()).second)
+		{
+			imports.push_back({ rel.moduleID, rel.targetSection, rel.addend });
+		}
+	}
+	if (imports.size() > static_cast<size_t>(cMaxLazyImports))
+	{
+		printf("%zu functions are called through lazy imports, the stub table holds at most %d\n", imports.size(), cMaxLazyImports);
+		return false;
+	}
+
+	if (!imports.empty())
+	{
+		module.stubTable.offset = (module.dataEnd + 3) & ~3;
+		module.stubTable.data = buildLazyStubTable(imports);
+		stubSection.offset = module.stubTable.offset;
+		stubSection.size = static_cast<int>(module.stubTable.data.size());
+
+		for (const auto &rel : calls)
+		{
+			size_t index = importIndices[{ rel.moduleID, rel.targetSection, rel.addend }];
+			int offset = module.sectionPlacements[rel.section].offset + static_cast<int>(rel.offset);
+			int delta = module.stubTable.offset + getLazyStubOffset(imports.size(), index) - offset;
+			uint32_t data = loadInstruction(module, rel.section, rel.offset);
+			patchInstruction(module, rel.section, rel.offset, resolveEarlyRelocation(data, R_PPC_REL24, delta));
+		}
+
+		// The runtime is either in this module or in the symbol files
+		int bindOffset = getLazyBindBranchOffset();
+		const SectionPlacement *bindPlacement = nullptr;
+		uint32_t bindTargetOffset = 0;
+		for (const auto &symbol : module.symbolTable)
+		{
+			if (symbol.name == cLazyBindSymbol && symbol.sectionIndex != SHN_UNDEF && symbol.sectionIndex < SHN_LORESERVE)
+			{
+				int sectionIndex = symbol.sectionIndex;
+				bindTargetOffset = static_cast<uint32_t>(symbol.value);
+				redirectTarget(module, sectionIndex, bindTargetOffset);
+				bindPlacement = findPlacement(module, sectionIndex);
+				break;
+			}
+		}
+		auto it = externalSymbolMap.find(std::string_view(cLazyBindSymbol));
+		if (bindPlacement)
+		{
+			int delta = bindPlacement->offset + static_cast<int>(bindTargetOffset) - (module.stubTable.offset + bindOffset);
+			module.patches.push_back({ module.stubTable.offset + bindOffset,
+									   resolveEarlyRelocation(loadAt<uint32_t>(module.stubTable.data, bindOffset), R_PPC_REL24, delta) });
+		}
+		else if (it != externalSymbolMap.end())
+		{
+			if (module.stubTable.relSection > 255)
+			{
+				printf("Lazy import stubs would be REL section %d but relocations can only refer to sections up to 255 (try --coalesce-sections)\n",
+					   module.stubTable.relSection);
+				return false;
+			}
+			stubRelocations.push_back({ it->second.moduleId,
+										static_cast<uint32_t>(module.stubTable.relSection),
+										static_cast<uint32_t>(bindOffset),
+										it->second.targetSection,
+										it->second.addr,
+										R_PPC_REL24 });
+		}
+		else
+		{
+			printf("Lazy imports need '%s', compile the runtime written by --lazy-runtime-out into the dol or the module\n", cLazyBindSymbol);
+			return false;
+		}
+	}
+
+	std::vector<uint8_t> sectionInfoBuffer;
+	writeSectionInfo(sectionInfoBuffer, stubSection.offset == 0 ? 0 : stubSection.offset | 1, stubSection.size);
+	std::copy(sectionInfoBuffer.begin(), sectionInfoBuffer.end(),
+			  module.headerBuffer.begin() + module.sectionInfoOffset + module.stubTable.relSection * sectionInfoBuffer.size());
+	module.report.lazyCalls = static_cast<int>(calls.size());
+	return true;
+}
+
+bool linkModule(RelModule &module, const SymbolMap &externalSymbolMap)
+{
+	TraceScope trace("Link module", module.elfFilename);
+	MemoryPhaseScope memoryPhase(MemoryPhase::Relocations);
+	std::vector<uint8_t> &tableBuffer = module.tableBuffer;
+	// Offsets in a separate relocation file are from its start
+	int tableBase = 0;
+	auto getFileOffset = [&]()
+	{
+		return tableBase + static_cast<int>(tableBuffer.size());
+	};
+	int moduleID = module.options.moduleID;
+
+	// Start over from the collected relocations, a module can be linked
+	// against several symbol maps
+	tableBuffer.clear();
+	module.patches.resize(module.earlyPatchCount);
+	module.report = module.collectionReport;
+	RelocationReport &report = module.report;
+
+	std::pmr::deque<Relocation> allRelocations(module.internalRelocations.begin(),
+											   module.internalRelocations.end(),
+											   module.arena.getResource());
+	std::vector<Relocation> lazyCalls;
+	for (const auto &external : module.externalRelocations)
+	{
+		// Check if it's an external known symbol
+		auto it = externalSymbolMap.find(external.symbolName);
+		if (it == externalSymbolMap.end())
+		{
+			printf("Unresolved external symbol '%s'\n", external.symbolName.data());
+			report.unresolved++;
+			continue;
+		}
+
+		Relocation rel = external.relocation;
+		rel.moduleID = it->second.moduleId;
+		rel.targetSection = it->second.targetSection;
+		rel.addend += it->second.addr;
+
+		// OSLink has no small data relocations, they only work against the dol
+		if (rel.type == R_PPC_SDAREL16 || rel.type == R_PPC_EMB_SDA21)
+		{
+			if (resolveSmallData(module, rel, externalSymbolMap, external.symbolName))
+			{
+				report.earlyResolved++;
+			}
+			else
+			{
+				report.unresolved++;
+			}
+			continue;
+		}
+
+		if (module.stubTable.relSection != -1
+			&& rel.type == R_PPC_REL24
+			&& rel.moduleID != 0
+			&& rel.moduleID != static_cast<uint32_t>(moduleID))
+		{
+			lazyCalls.push_back(rel);
+			continue;
+		}
+
+		// Symbols resolved to this module through the symbol map
+		if (resolveEarly(module, rel))
+		{
+			report.earlyResolved++;
+			continue;
+		}
+		allRelocations.emplace_back(rel);
+	}
+
+	module.tableOffset = module.dataEnd;
+	std::vector<Relocation> stubRelocations;
+	if (module.stubTable.relSection != -1)
+	{
+		TraceScope stubTrace("Build lazy import stubs");
+		if (!buildLazyStubs(module, lazyCalls, externalSymbolMap, stubRelocations))
+		{
+			return false;
+		}
+		module.tableOffset = module.stubTable.offset + static_cast<int>(module.stubTable.data.size());
+	}
+	bool splitRelocations = module.options.splitRelocations;
+	tableBase = splitRelocations ? 0 : module.tableOffset;
+
+	if (module.options.relaxSmallData)
+	{
+		TraceScope relaxTrace("Relax small data accesses");
+		relaxSmallDataAccesses(module, allRelocations, externalSymbolMap);
+	}
+
+	// Relocations are written against REL sections
+	for (auto &rel : allRelocations)
+	{
+		const SectionPlacement &site = module.sectionPlacements[rel.section];
+		rel.section = site.relSection;
+		rel.offset += site.relOffset;
+	}
+	allRelocations.insert(allRelocations.end(), stubRelocations.begin(), stubRelocations.end());
+
+	// Returns whether a module should be placed at the end of relocations for trimming
+	auto getModuleDelay = [moduleID](uint32_t id)
+	{
+		return getRelocationModuleDelay(id, moduleID);
+	};
+
+	// Sort relocations
+	{
+		TraceScope sortTrace("Sort relocations");
+		std::sort(allRelocations.begin(), allRelocations.end(),
+				  [&](const Relocation &left, const Relocation &right)
+		{
+			return isRelocationBefore(left, right, moduleID);
+		});
+	}
+	TraceScope emitTrace("Emit relocations");
+
+	// Count modules
+	int importCount = 0;
+	int lastModuleID = -1;
+	for (const auto &rel : allRelocations)
+	{
+		if (lastModuleID != static_cast<int>(rel.moduleID))
+		{
+			lastModuleID = rel.moduleID;
+			++importCount;
+		}
+	}
+
+	// Write padding for imports
+	int requiredPadding = splitRelocations ? 0 : 8 - getFileOffset() % 8;
+	for (int i = 0; i < requiredPadding; ++i)
+	{
+		save<uint8_t>(tableBuffer, 0);
+	}
+
+	// Write dummy imports
+	int importInfoOffset = getFileOffset();
+	for (int i = 0; i < importCount; ++i)
+	{
+		writeImportInfo(tableBuffer, 0, 0);
+	}
+
+	// Write out relocations
+	int relocationOffset = getFileOffset();
+	auto emitRelocation = [&](int importModuleID, int section, int offset, int type, int targetSection, uint32_t addend)
+	{
+		writeRelocation(tableBuffer, offset, type, targetSection, addend);
+		if (importModuleID != -1)
+		{
+			report.addRecord(importModuleID, section, type);
+		}
+	};
+
+	std::vector<uint8_t> importInfoBuffer;
+	int currentModuleID = -1;
+	int currentSectionIndex = -1;
+	int currentOffset = 0;
+	int fixedRelocationsSize = 0;
+	while (!allRelocations.empty())
+	{
+		Relocation nextRel = allRelocations.front();
+		allRelocations.pop_front();
+
+		// Change module if necessary
+		if (currentModuleID != static_cast<int>(nextRel.moduleID))
+		{
+			// Not first module?
+			if (currentModuleID != -1)
+			{
+				emitRelocation(currentModuleID, currentSectionIndex, 0, R_DOLPHIN_END, 0, 0);
+			}
+
+			// If the next module ID was forced to the back and the current one wasn't,
+			// then this is the end of the relocations included in the fixed size
+			if (getModuleDelay(nextRel.moduleID) > getModuleDelay(currentModuleID))
+			{
+				fixedRelocationsSize = getFileOffset() - relocationOffset;
+			}
+
+			currentModuleID = nextRel.moduleID;
+			currentSectionIndex = -1;
+			writeImportInfo(importInfoBuffer, currentModuleID, getFileOffset());
+		}
+
+		// Change section if necessary
+		if (currentSectionIndex != static_cast<int>(nextRel.section))
+		{
+			currentSectionIndex = nextRel.section;
+			currentOffset = 0;
+			emitRelocation(currentModuleID, currentSectionIndex, 0, R_DOLPHIN_SECTION, currentSectionIndex, 0);
+		}
+
+		// Get into range of the target
+		int targetDelta = nextRel.offset - currentOffset;
+		while (targetDelta > 0xFFFF)
+		{
+			emitRelocation(currentModuleID, currentSectionIndex, 0xFFFF, R_DOLPHIN_NOP, 0, 0);
+			targetDelta -= 0xFFFF;
+		}
+
+		// At this point, only symbols that OSLink can handle should remain
+		switch (nextRel.type)
+		{
+		case R_PPC_NONE:
+		case R_PPC_ADDR32:
+		case R_PPC_ADDR24:
+		case R_PPC_ADDR16:
+		case R_PPC_ADDR16_LO:
+		case R_PPC_ADDR16_HI:
+		case R_PPC_ADDR16_HA:
+		case R_PPC_ADDR14:
+		case R_PPC_ADDR14_BRTAKEN:
+		case R_PPC_ADDR14_BRNKTAKEN:
+		case R_PPC_REL24:
+		case R_DOLPHIN_NOP:
+		case R_DOLPHIN_SECTION:
+		case R_DOLPHIN_END:
+			break;
+		default:
+			printf("Unsupported relocation type %d\n", nextRel.type);
+			break;
+		}
+
+		emitRelocation(currentModuleID, currentSectionIndex, targetDelta, nextRel.type, nextRel.targetSection, nextRel.addend);
+		currentOffset = nextRel.offset;
+		if (getModuleDelay(currentModuleID))
+		{
+			report.deferred++;
+		}
+	}
+	emitRelocation(currentModuleID, currentSectionIndex, 0, R_DOLPHIN_END, 0, 0);
+
+	// If the final module referenced isn't forced to the back, then all
+	// relocations must be included in the fixed size
+	if (getModuleDelay(currentModuleID) == 0)
+	{
+		fixedRelocationsSize = getFileOffset() - relocationOffset;
+	}
+
+	// Write final import infos
+	int importInfoSize = importInfoBuffer.size();
+	std::copy(importInfoBuffer.begin(), importInfoBuffer.end(), tableBuffer.begin() + (importInfoOffset - tableBase));
+		
+	// OSLink walks the imports of every linked module when another module is
+	// linked or unlinked, only the dol and self imports it drops after
+	// linking can go to a file that is freed
+	if (splitRelocations && fixedRelocationsSize > 0)
+	{
+		printf("Relocations against other modules cannot be written to a separate file, OSLink still needs them once the file is freed\n");
+		return false;
+	}
+
+	// Init sections can be freed after _prolog together with the trimmed
+	// relocations unless something that stays resident follows them
+	int fixedDataSize = splitRelocations ? module.tableOffset : relocationOffset + fixedRelocationsSize;
+	if (module.initOffset < module.dataEnd)
+	{
+		if (!module.stubTable.data.empty())
+		{
+			printf("Init sections stay resident, the lazy import stubs are placed after them\n");
+		}
+		else if (fixedRelocationsSize > 0)
+		{
+			printf("Init sections stay resident, relocations against other modules are kept after them\n");
+		}
+		else
+		{
+			fixedDataSize = module.initOffset;
+			report.initBytes = module.dataEnd - module.initOffset;
+		}
+	}
+
+	// Write final header
+	std::vector<uint8_t> headerBuffer;
+	writeModuleHeader(headerBuffer,
+					  module.options.relVersion,
+					  moduleID,
+					  module.relSections.size(),
+					  module.sectionInfoOffset,
+					  module.totalBssSize,
+					  relocationOffset,
+					  importInfoOffset,
+					  importInfoSize,
+					  module.prologSectionIndex, module.epilogSectionIndex, module.unresolvedSectionIndex,
+					  module.prologOffset, module.epilogOffset, module.unresolvedOffset,
+					  module.stubTable.data.empty() ? module.maxAlign : std::max(module.maxAlign, 4),
+					  module.maxBssAlign,
+					  fixedDataSize);
+	std::copy(headerBuffer.begin(), headerBuffer.end(), module.headerBuffer.begin());
+
+	report.importBytes = importInfoSize;
+	report.relocationBytes = getFileOffset() - relocationOffset;
+	report.fixedRelocationBytes = fixedRelocationsSize;
+	for (size_t i = 0; i < module.zeroDataSections.size(); ++i)
+	{
+		if (module.zeroDataSections[i] && module.sectionPlacements[i].placed)
+		{
+			report.zeroDataBytes += module.sectionPlacements[i].size;
+		}
+	}
+	for (const auto &section : report.sections)
+	{
+		report.sectionNames[section.first] = module.relSections[section.first].name;
+	}
+
+	return true;
+}
+
+std::vector<std::pair<std::string, SymbolLocation>> getExportedSymbols(RelModule &module)
+{
+	// Global symbols in kept sections, at their final REL section and offset
+	std::vector<std::pair<std::string, SymbolLocation>> exportedSymbols;
+	for (const auto &symbol : module.symbolTable)
+	{
+		if (symbol.name.empty()
+			|| (symbol.bind != STB_GLOBAL && symbol.bind != STB_WEAK)
+			|| symbol.sectionIndex == SHN_UNDEF
+			|| symbol.sectionIndex >= SHN_LORESERVE
+			|| symbol.name == "_prolog" // every module defines these, OSLink finds them through the header
+			|| symbol.name == "_epilog"
+			|| symbol.name == "_unresolved")
+		{
+			continue;
+		}
+
+		int targetSection = symbol.sectionIndex;
+		uint32_t targetOffset = static_cast<uint32_t>(symbol.value);
+		redirectTarget(module, targetSection, targetOffset);
+		const SectionPlacement *placement = findPlacement(module, targetSection);
+		if (!placement)
+		{
+			continue;
+		}
+		exportedSymbols.emplace_back(symbol.name, SymbolLocation{ static_cast<uint32_t>(module.options.moduleID),
+														   static_cast<uint32_t>(placement->relSection),
+														   targetOffset + placement->relOffset });
+	}
+
+	return exportedSymbols;
+}
+
+void writeLayoutMap(std::ostream &stream, RelModule &module)
+{
+	ELFIO::elfio &inputElf = module.inputElf;
+	// Collect named symbols by their final section
+	std::map<int, std::vector<std::pair<uint32_t, std::string_view>>> sectionSymbols;
+	for (const auto &symbol : module.symbolTable)
+	{
+		if (symbol.name.empty()
+			|| symbol.type == STT_SECTION
+			|| symbol.type == STT_FILE
+			|| symbol.sectionIndex == SHN_UNDEF
+			|| symbol.sectionIndex >= SHN_LORESERVE)
+		{
+			continue;
+		}
+		sectionSymbols[symbol.sectionIndex].emplace_back(static_cast<uint32_t>(symbol.value), symbol.name);
+	}
+
+	stream << "# section  offset          rel offset  size        align  padding  name\n";
+	stream << "# section is the REL section, offset is from the start of the REL and rel\n";
+	stream << "# offset from the start of the REL section. bss offsets are relative to the\n";
+	stream << "# start of the bss block\n";
+	char line[256];
+	auto formatOffset = [](bool bss, uint32_t offset)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%s0x%08x", bss ? "bss+" : "", offset);
+		return std::string(buffer);
+	};
+	for (const auto &section : inputElf.sections)
+	{
+		int sectionIndex = section->get_index();
+		auto symbolsIt = sectionSymbols.find(sectionIndex);
+		std::vector<std::pair<uint32_t, std::string_view>> definedSymbols;
+		if (symbolsIt != sectionSymbols.end())
+		{
+			definedSymbols = symbolsIt->second;
+		}
+
+		if (const SectionPlacement *placement = findPlacement(module, sectionIndex))
+		{
+			snprintf(line, sizeof(line), "%-9d  %-14s  0x%08x  0x%08x  %-5d  %-7d  %s\n",
+					 placement->relSection,
+					 formatOffset(placement->bss, placement->offset).c_str(),
+					 placement->relOffset,
+					 placement->size,
+					 placement->align,
+					 placement->padding,
+					 section->get_name().c_str());
+			stream << line;
+		}
+		else
+		{
+			// Only mention removed sections if they were replaced by another one
+			int targetSection = sectionIndex;
+			uint32_t targetOffset = 0;
+			redirectTarget(module, targetSection, targetOffset);
+			const SectionPlacement *target = findPlacement(module, targetSection);
+			if (targetSection == sectionIndex || !target)
+			{
+				continue;
+			}
+			snprintf(line, sizeof(line), "%-9s  replaced by REL section %-30d  %s\n",
+					 "-",
+					 target->relSection,
+					 section->get_name().c_str());
+			stream << line;
+		}
+
+		std::vector<std::tuple<bool, uint32_t, uint32_t, std::string_view>> relSymbols;
+		for (const auto &symbol : definedSymbols)
+		{
+			int targetSection = sectionIndex;
+			uint32_t targetOffset = symbol.first;
+			redirectTarget(module, targetSection, targetOffset);
+			if (const SectionPlacement *target = findPlacement(module, targetSection))
+			{
+				relSymbols.emplace_back(target->bss, target->offset + targetOffset, target->relOffset + targetOffset, symbol.second);
+			}
+		}
+		std::sort(relSymbols.begin(), relSymbols.end());
+		for (const auto &symbol : relSymbols)
+		{
+			snprintf(line, sizeof(line), "           %-14s  0x%08x  ",
+					 formatOffset(std::get<0>(symbol), std::get<1>(symbol)).c_str(),
+					 std::get<2>(symbol));
+			stream << line << std::get<3>(symbol) << "\n";
+		}
+	}
+}
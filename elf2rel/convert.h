@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright 2019 Linus S. (aka PistonMiner)
+
+#pragma once
+
+#include "arena.h"
+#include "passes.h"
+#include "report.h"
+#include "symbols.h"
+
+#include "elfio/elfio.hpp"
+
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+struct ConversionOptions
+{
+	int moduleID = 0x1000;
+	int relVersion = 3;
+	bool foldIdentical = false;
+	bool mergeConstants = false;
+	bool resolveEarly = true; // patch branches within the module instead of leaving them to OSLink
+	std::vector<std::string> keepSectionPatterns; // kept in addition to the usual REL sections
+	std::string relocationCacheFilename; // reuse resolved relocations of unchanged sections
+	bool dedupWeakSymbols = false; // use the dol's copy of weak symbols it also defines
+	std::vector<std::string> dedupSymbols; // same for these symbols regardless of binding
+	bool relaxSmallData = false; // turn lis/addi pairs against dol small data into r13/r2 relative accesses
+	std::vector<std::string> symbolOrdering; // functions whose sections are placed first, hottest first
+	int orderedSectionAlign = 0; // minimum alignment of the sections in symbolOrdering
+	bool coalesceSections = false; // place .text.* in .text and so on instead of one REL section per ELF section
+	bool lazyImports = false; // call functions in other modules through stubs bound on first use
+	std::vector<std::string> exportTableSymbols; // symbols in the REL's export table
+	bool exportTableHashesOnly = false; // leave the names out of the export table
+	bool splitRelocations = false; // tableBuffer goes to a file of its own instead of the REL
+	std::vector<std::string> initSectionPatterns; // sections only used by _prolog, placed last so they can be freed
+	bool zeroDataToBss = false; // place all-zero .data sections without relocations in bss
+};
+
+// Where an input section was placed in the REL
+struct SectionPlacement
+{
+	bool placed = false; // false for removed sections and ones replaced by another section
+	bool bss = false;
+	bool exec = false;
+	int offset = 0; // from the start of the REL, or from the start of the bss block
+	int size = 0;
+	int align = 0;
+	int padding = 0;
+	bool modified = false; // data was rewritten by a pass and is not in the input file
+	int relSection = 0; // REL section containing the section
+	int relOffset = 0; // from the start of the REL section
+};
+
+// Entry of the REL's section table
+struct RelSection
+{
+	std::string name;
+	bool bss = false;
+	bool exec = false;
+	bool init = false; // only used by _prolog, placed after the other sections
+	int offset = 0; // from the start of the REL, or from the start of the bss block
+	int size = 0;
+};
+
+// REL section whose data elf2rel generates instead of copying it from the
+// input
+struct GeneratedSection
+{
+	int relSection = -1; // -1 if the section is not written
+	int offset = 0; // from the start of the REL
+	std::vector<uint8_t> data;
+};
+
+// Symbol table entry, read once when the module is loaded
+struct ModuleSymbol
+{
+	std::string_view name; // interned in the module's arena
+	ELFIO::Elf64_Addr value;
+	ELFIO::Elf_Xword size;
+	unsigned char bind;
+	unsigned char type;
+	ELFIO::Elf_Half sectionIndex;
+};
+
+// Relocation that will be written to the REL or resolved early
+struct Relocation
+{
+	uint32_t moduleID; // target module
+	uint32_t section;
+	uint32_t offset;
+	uint32_t targetSection; // target symbol
+	uint32_t addend;
+	uint8_t type;
+};
+
+// Relocation against a symbol the module does not define. Its target module,
+// section and final addend come from the symbol map when linking.
+struct ExternalRelocation
+{
+	Relocation relocation; // addend excludes the symbol's address
+	std::string_view symbolName;
+};
+
+// Word in the section data that is replaced when the REL is written
+struct RelPatch
+{
+	int offset; // from the start of the REL
+	uint32_t value;
+};
+
+// An ELF being converted to a REL. Conversion runs in phases so several
+// modules can be laid out before any of them resolves symbols against the
+// others:
+//   loadModule          - reads the ELF
+//   redirectToDolCopies - optionally replaces symbols with the dol's copies
+//   layoutModule        - merges and folds sections and places the section data
+//   collectRelocations  - reads relocations and resolves those within the module
+//   linkModule          - resolves external symbols and writes imports,
+//                         relocations and header, can be repeated with other
+//                         symbol maps
+struct RelModule
+{
+	ConversionOptions options;
+
+	// Owns the symbol names and scratch data of the conversion, declared first
+	// so it outlives everything allocated from it
+	Arena arena;
+
+	std::string elfFilename;
+	ELFIO::elfio inputElf;
+	ELFIO::section *symSection = nullptr;
+	std::vector<ELFIO::section *> relocationSections;
+	std::unique_ptr<ELFIO::symbol_section_accessor> symbols;
+	std::pmr::vector<ModuleSymbol> symbolTable{ arena.getResource() };
+
+	std::map<int, MergedSection> mergedSections;
+	std::map<int, int> foldedSections;
+
+	int prologSectionIndex = 0, prologOffset = 0;
+	int epilogSectionIndex = 0, epilogOffset = 0;
+	int unresolvedSectionIndex = 0, unresolvedOffset = 0;
+
+	// Indexed by input section index
+	std::vector<bool> keptSections;
+	std::vector<bool> zeroDataSections; // placed in bss although they have data
+	std::vector<SectionPlacement> sectionPlacements;
+
+	// Indexed by REL section index, the same as the input section index
+	// unless sections are coalesced
+	std::vector<RelSection> relSections;
+
+	// Indexed by symbol index, symbols whose relocations go to the dol's copy
+	std::vector<bool> dolCopies;
+
+	// Export table placed by layoutModule after the section data and lazy
+	// import stubs placed by linkModule after that
+	GeneratedSection exportTable;
+	GeneratedSection stubTable;
+
+	// The REL is never assembled in memory. writeRelFile writes headerBuffer
+	// (header and section table), copies the placed section data from the
+	// input, writes the generated sections and tableBuffer (imports and
+	// relocations) at tableOffset and applies the patches. With split
+	// relocations, tableBuffer is written to its own file instead and the
+	// header's import and relocation offsets are from the start of that file.
+	std::vector<uint8_t> headerBuffer;
+	std::vector<uint8_t> tableBuffer;
+	std::vector<RelPatch> patches;
+	int dataEnd = 0; // end of the placed section data
+	int initOffset = 0; // start of the init sections, dataEnd without any
+	int tableOffset = 0;
+	int sectionInfoOffset = 0;
+
+	int totalBssSize = 0;
+	int maxAlign = 2;
+	int maxBssAlign = 2;
+
+	// Independent of the symbol map, the first earlyPatchCount patches are
+	// the relocations resolved early by collectRelocations
+	std::pmr::vector<Relocation> internalRelocations{ arena.getResource() };
+	std::pmr::vector<ExternalRelocation> externalRelocations{ arena.getResource() };
+	size_t earlyPatchCount = 0;
+	RelocationReport collectionReport;
+
+	RelocationReport report;
+};
+
+bool loadModule(RelModule &module, const std::string &elfFilename);
+// Sections whose symbols all come from the dol are dropped unless something
+// else in the module refers to them. A symbol is only replaced if every
+// symbol map has it in the dol.
+void redirectToDolCopies(RelModule &module, const std::vector<const SymbolMap *> &symbolMaps);
+void layoutModule(RelModule &module);
+bool collectRelocations(RelModule &module);
+bool linkModule(RelModule &module, const SymbolMap &externalSymbolMap);
+
+// 1 if relocations against the target module are placed at the end of the
+// relocation table so OSLinkFixed can trim them, 0 otherwise
+int getRelocationModuleDelay(uint32_t targetModuleID, uint32_t moduleID);
+
+// Order of relocations in the REL of module moduleID
+bool isRelocationBefore(const Relocation &left, const Relocation &right, uint32_t moduleID);
+
+// Applies a R_PPC_REL24 or R_PPC_REL32 within the module to the original data
+uint32_t resolveEarlyRelocation(uint32_t data, int type, int delta);
+
+// Patches a relocation within the module into the section data if OSLink does
+// not need to see it, OSLink cannot handle R_PPC_REL32 at all. Returns false
+// for relocations left to OSLink.
+bool resolveEarly(RelModule &module, const Relocation &rel);
+
+// Moves a target into the section that replaced its original section
+void redirectTarget(const RelModule &module, int &sectionIndex, uint32_t &offset);
+
+// Placement of a section in the REL, null if the section was not placed
+const SectionPlacement *findPlacement(const RelModule &module, int sectionIndex);
+
+// Global symbols in kept sections, at their final REL section and offset
+std::vector<std::pair<std::string, SymbolLocation>> getExportedSymbols(RelModule &module);
+
+// Writes every kept input section's placement together with the REL relative
+// offsets of the symbols it defines
+void writeLayoutMap(std::ostream &stream, RelModule &module);
+
+void writeModuleHeader(std::vector<uint8_t> &buffer,
+					   int version,
+					   int id,
+					   int sectionCount,
+					   int sectionInfoOffset,
+					   int totalBssSize,
+					   int relocationOffset,
+					   int importInfoOffset,
+					   int importInfoSize,
+					   int prologSection,
+					   int epilogSection,
+					   int unresolvedSection,
+					   int prologOffset,
+					   int epilogOffset,
+					   int unresolvedOffset,
+					   int maxAlign,
+					   int maxBssAlign,
+					   int fixedDataSize);
+void writeSectionInfo(std::vector<uint8_t> &buffer, int offset, int size);
+void writeImportInfo(std::vector<uint8_t> &buffer, int id, int offset);
+void writeRelocation(std::vector<uint8_t> &buffer, int offset, int type, int section, uint32_t addend);
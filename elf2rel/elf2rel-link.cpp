@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Links RELs in host memory the way OSLink/OSLinkFixed would, to check what
+// elf2rel produced and how much work loading it is.
+
+#include "oslink.h"
+#include "report.h"
+
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <list>
+
+struct LinkJob
+{
+	std::string filename;
+	std::string relocationsFilename; // tables written separately by elf2rel --relocations-out
+	uint32_t address;
+};
+
+bool parseAddress(const std::string &str, uint32_t &out)
+{
+	try
+	{
+		size_t len;
+		out = std::stoul(str, &len, 16);
+		return len == str.length();
+	}
+	catch (std::exception &)
+	{
+		return false;
+	}
+}
+
+bool readFile(const std::string &filename, std::vector<uint8_t> &data)
+{
+	std::ifstream inputStream(filename, std::ios::binary);
+	if (!inputStream)
+	{
+		return false;
+	}
+	data.assign(std::istreambuf_iterator<char>(inputStream), std::istreambuf_iterator<char>());
+	return true;
+}
+
+// Loads and links the dependencies followed by the module itself. Modules are
+// kept in a list so the context's pointers to them stay valid.
+bool linkAll(const std::vector<LinkJob> &dependencies,
+			 const LinkJob &job,
+			 uint32_t bssAddress,
+			 bool fixed,
+			 std::list<LinkedModule> &modules,
+			 LinkContext &context,
+			 LinkStats &stats)
+{
+	for (size_t i = 0; i <= dependencies.size(); ++i)
+	{
+		const LinkJob &current = i < dependencies.size() ? dependencies[i] : job;
+		std::vector<uint8_t> data;
+		if (!readFile(current.filename, data))
+		{
+			printf("Failed to read '%s'\n", current.filename.c_str());
+			return false;
+		}
+		uint32_t relocationsOffset = 0;
+		if (!current.relocationsFilename.empty())
+		{
+			std::vector<uint8_t> relocations;
+			if (!readFile(current.relocationsFilename, relocations))
+			{
+				printf("Failed to read '%s'\n", current.relocationsFilename.c_str());
+				return false;
+			}
+			relocationsOffset = attachRelocationFile(data, relocations);
+		}
+
+		// Only the module being measured counts towards the statistics
+		LinkStats dependencyStats;
+		LinkStats &currentStats = &current == &job ? stats : dependencyStats;
+		std::string error;
+		modules.emplace_back();
+		if (!context.load(modules.back(), data, current.address, &current == &job ? bssAddress : 0, error)
+			|| !context.link(modules.back(), fixed, currentStats, error))
+		{
+			printf("Failed to link '%s': %s\n", current.filename.c_str(), error.c_str());
+			return false;
+		}
+
+		// The loader frees the relocation file once the module is linked,
+		// OSLink must not walk any of its imports after that
+		if (relocationsOffset)
+		{
+			if (modules.back().header.importInfoSize > 0)
+			{
+				printf("Failed to link '%s': OSLink keeps using the imports in '%s', which is freed after linking\n",
+					   current.filename.c_str(),
+					   current.relocationsFilename.c_str());
+				return false;
+			}
+			modules.back().image.resize(relocationsOffset);
+		}
+	}
+	return true;
+}
+
+void writeStats(std::ostream &stream, const LinkedModule &module, const LinkStats &stats)
+{
+	char line[128];
+	snprintf(line, sizeof(line), "Module %u at %08x, bss at %08x\n", module.header.id, module.baseAddress, module.bssAddress);
+	stream << line;
+	stream << "Relocations applied: " << stats.relocationsApplied << " (" << stats.bytesTouched << " bytes touched)\n";
+	for (const auto &type : stats.types)
+	{
+		stream << "  " << getRelocationTypeName(type.first) << ": " << type.second << "\n";
+	}
+	stream << "Section switches: " << stats.sectionSwitches << "\n";
+	stream << "Imports of modules not loaded: " << stats.importsSkipped << "\n";
+	stream << "Bytes trimmed by fixedDataSize: " << stats.bytesTrimmed << "\n";
+	stream << "Estimated OSLink cost: " << stats.estimatedCycles << " cycles\n";
+}
+
+// Compares the linked contents of every section, headers and relocation tables
+// are allowed to differ
+bool compareSections(const LinkedModule &left, const LinkedModule &right)
+{
+	if (left.sections.size() != right.sections.size())
+	{
+		printf("Section counts differ: %zu and %zu\n", left.sections.size(), right.sections.size());
+		return false;
+	}
+
+	bool identical = true;
+	for (size_t i = 0; i < left.sections.size(); ++i)
+	{
+		const LinkedSection &l = left.sections[i];
+		const LinkedSection &r = right.sections[i];
+		if (l.address != r.address || l.size != r.size || l.bss != r.bss)
+		{
+			printf("Section %zu: placed at %08x+%x and %08x+%x\n", i, l.address, l.size, r.address, r.size);
+			identical = false;
+			continue;
+		}
+		if (l.bss || l.address == 0)
+		{
+			continue;
+		}
+
+		const uint8_t *leftData = left.image.data() + (l.address - left.baseAddress);
+		const uint8_t *rightData = right.image.data() + (r.address - right.baseAddress);
+		auto mismatch = std::mismatch(leftData, leftData + l.size, rightData);
+		if (mismatch.first != leftData + l.size)
+		{
+			uint32_t offset = static_cast<uint32_t>(mismatch.first - leftData);
+			printf("Section %zu: contents differ at %08x\n", i, l.address + offset);
+			identical = false;
+		}
+	}
+	return identical;
+}
+
+int main(int argc, char **argv)
+{
+	LinkJob job;
+	std::string baseAddress;
+	std::string bssAddress;
+	std::vector<std::string> dependencySpecs;
+	std::string dumpFilename;
+	std::string compareFilename;
+	bool fixed = false;
+
+	{
+		namespace po = boost::program_options;
+
+		po::options_description description("Options");
+		description.add_options()
+			("help", "Print help message")
+			("input-file,i", po::value(&job.filename), "REL to link (required)")
+			("relocations", po::value(&job.relocationsFilename), "Imports and relocations of the REL written by elf2rel --relocations-out")
+			("base", po::value(&baseAddress)->default_value("80500000"), "Address the REL is loaded at (hex)")
+			("bss", po::value(&bssAddress), "Address of the REL's bss (hex, defaults to right after the REL)")
+			("load", po::value(&dependencySpecs)->multitoken(), "Modules loaded and linked before the REL, given as REL@address")
+			("fixed", po::bool_switch(&fixed), "Link like OSLinkFixed")
+			("dump", po::value(&dumpFilename), "Write the linked REL image to this file")
+			("compare", po::value(&compareFilename), "Link this REL in the same way and compare the linked sections");
+
+		po::positional_options_description positionals;
+		positionals.add("input-file", -1);
+
+		po::variables_map varMap;
+		po::store(
+			po::command_line_parser(argc, argv)
+				.options(description)
+				.positional(positionals)
+				.run(),
+			varMap
+		);
+		po::notify(varMap);
+
+		if (varMap.count("help") || varMap.count("input-file") != 1)
+		{
+			std::cout << description << "\n";
+			return 1;
+		}
+	}
+
+	uint32_t bss = 0;
+	if (!parseAddress(baseAddress, job.address)
+		|| (!bssAddress.empty() && !parseAddress(bssAddress, bss)))
+	{
+		printf("Invalid address\n");
+		return 1;
+	}
+
+	std::vector<LinkJob> dependencies;
+	for (const auto &spec : dependencySpecs)
+	{
+		size_t separator = spec.find('@');
+		LinkJob dependency;
+		dependency.filename = spec.substr(0, separator);
+		if (separator == std::string::npos || !parseAddress(spec.substr(separator + 1), dependency.address))
+		{
+			printf("Invalid module '%s', expected REL@address\n", spec.c_str());
+			return 1;
+		}
+		dependencies.push_back(dependency);
+	}
+
+	std::list<LinkedModule> modules;
+	LinkContext context;
+	LinkStats stats;
+	if (!linkAll(dependencies, job, bss, fixed, modules, context, stats))
+	{
+		return 1;
+	}
+	writeStats(std::cout, modules.back(), stats);
+
+	if (!dumpFilename.empty())
+	{
+		const LinkedModule &module = modules.back();
+		std::ofstream dumpStream(dumpFilename, std::ios::binary);
+		dumpStream.write(reinterpret_cast<const char *>(module.image.data()), module.image.size());
+	}
+
+	if (!compareFilename.empty())
+	{
+		// Same addresses, the files may differ in size
+		LinkJob other = job;
+		other.filename = compareFilename;
+		other.relocationsFilename.clear();
+		std::list<LinkedModule> otherModules;
+		LinkContext otherContext;
+		LinkStats otherStats;
+		if (!linkAll(dependencies, other, modules.back().bssAddress, fixed, otherModules, otherContext, otherStats))
+		{
+			return 1;
+		}
+		std::cout << "\n";
+		writeStats(std::cout, otherModules.back(), otherStats);
+		std::cout << "\n";
+		if (!compareSections(modules.back(), otherModules.back()))
+		{
+			return 1;
+		}
+		std::cout << "Linked sections are identical\n";
+	}
+
+	return 0;
+}
@@ -2,192 +2,310 @@
 // Copyright 2019 Linus S. (aka PistonMiner)
 
 #include "elf2rel.h"
-
-#include "elfio/elfio.hpp"
+#include "convert.h"
+#include "exports.h"
+#include "lazy.h"
+#include "memstats.h"
+#include "report.h"
+#include "symbols.h"
+#include "trace.h"
+#include "writer.h"
 
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <iostream>
 #include <fstream>
-#include <tuple>
-#include <deque>
+#include <atomic>
+#include <functional>
+#include <thread>
 
-struct SymbolLocation
+// Per module outputs besides the REL itself. When converting several modules,
+// a % in a filename is replaced by the module's REL filename without extension.
+struct OutputOptions
 {
-	uint32_t moduleId; // 0 means dol
-	uint32_t targetSection; // OSLink ignores for dol
-	uint32_t addr;
+	std::string reportFilename;
+	std::string reportFormat;
+	int reportTopSymbols = 10;
+	std::string mapOutFilename;
+	std::string exportSymbolsFilename;
+	std::string exportFormat;
+	std::string relocationsFilename;
 };
 
-void trimAll(std::vector<std::string> &strs)
+// Symbol files of one build of the game, modules are linked once per region.
+// Without --region there is a single unnamed region writing the module's REL.
+struct SymbolRegion
 {
-	for (std::string &str : strs)
+	std::string name;
+	std::string relFilename; // % is replaced by the module's REL filename without extension
+	std::vector<std::string> mapFilenames;
+};
+
+struct ModuleJob
+{
+	std::string elfFilename;
+	std::string relFilename;
+	std::unique_ptr<RelModule> module;
+	bool succeeded = true;
+};
+
+// Runs fn for every index in [0, count) on up to jobCount threads
+void runParallel(int count, int jobCount, const std::function<void(int)> &fn)
+{
+	if (jobCount <= 1 || count <= 1)
 	{
-		boost::trim(str);
+		for (int i = 0; i < count; ++i)
+		{
+			fn(i);
+		}
+		return;
 	}
-}
 
-bool parseInt(const std::string &str, uint32_t &out, int base=0)
-{
-	try {
-		size_t len;
-		out = std::stoul(str, &len, base);
-		return len == str.length();
+	std::atomic<int> nextIndex(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < std::min(count, jobCount); ++i)
+	{
+		threads.emplace_back([&]()
+		{
+			for (int index = nextIndex++; index < count; index = nextIndex++)
+			{
+				fn(index);
+			}
+		});
 	}
-	catch (std::invalid_argument)
+	for (auto &thread : threads)
 	{
-		return false;
+		thread.join();
 	}
 }
 
-// dol symbols: addr:symbolName
-// rel symbols: module,section,offset:symbolName
-// module and section can be prefixed with 0x for hex or 0 for octal, addr/offset is always hex
-bool parseSymbol(const std::string &line, SymbolLocation &sym, std::string &name)
+std::string getModuleOutputFilename(const std::string &pattern, const std::string &relFilename)
 {
-	// Split around colon
-	std::vector<std::string> colonParts;
-	boost::split(colonParts, line, boost::is_any_of(":"));
-	if (colonParts.size() != 2)
-	{
-		return false;
-	}
-	trimAll(colonParts);
-	name = colonParts[1];
-
-	// Split first part around commas
-	std::vector<std::string> commaParts;
-	boost::split(commaParts, colonParts[0], boost::is_any_of(","));
-	if (commaParts.size() == 1)
-	{
-		// Dol
-		sym.moduleId = 0;
-		sym.targetSection = 0;
-		return parseInt(commaParts[0], sym.addr, 16);
-	}
-	else if (commaParts.size() == 3)
+	std::string stem = relFilename.substr(0, relFilename.find_last_of('.'));
+	return boost::replace_all_copy(pattern, "%", stem);
+}
+
+std::string getRegionRelFilename(const SymbolRegion &region, const std::string &relFilename)
+{
+	if (!region.relFilename.empty())
 	{
-		// Other rel
-		trimAll(commaParts);
-		return parseInt(commaParts[0], sym.moduleId)
-			&& parseInt(commaParts[1], sym.targetSection)
-			&& parseInt(commaParts[2], sym.addr, 16);
+		return getModuleOutputFilename(region.relFilename, relFilename);
 	}
-	else
+	if (region.name.empty())
 	{
-		return false;
+		return relFilename;
 	}
+	return getModuleOutputFilename("%." + region.name + ".rel", relFilename);
 }
 
-std::map<std::string, SymbolLocation> loadSymbolMap(const std::string &filename)
+bool writeModuleOutputs(RelModule &module, const std::string &relFilename, const OutputOptions &outputs)
 {
-	std::map<std::string, SymbolLocation> outputMap;
+	MemoryPhaseScope memoryPhase(MemoryPhase::Output);
 
-	std::ifstream inputStream(filename);
-	for (std::string line; std::getline(inputStream, line); )
+	// Write final REL file
 	{
-		boost::trim_left(line);
+		TraceScope trace("Write REL", relFilename);
+		if (!writeRelFile(module, relFilename))
+		{
+			printf("Failed to write output file '%s'\n", relFilename.c_str());
+			return false;
+		}
+	}
+	if (!outputs.relocationsFilename.empty())
+	{
+		std::string filename = getModuleOutputFilename(outputs.relocationsFilename, relFilename);
+		if (!writeRelocationFile(module, filename))
+		{
+			printf("Failed to write relocation file '%s'\n", filename.c_str());
+			return false;
+		}
+	}
+	TraceScope trace("Write module outputs", relFilename);
 
-		// Ignore comments
-		if (line.size() == 0 || line.find_first_of("//") == 0)
+	if (!outputs.exportSymbolsFilename.empty())
+	{
+		std::string filename = getModuleOutputFilename(outputs.exportSymbolsFilename, relFilename);
+		std::vector<std::pair<std::string, SymbolLocation>> exportedSymbols = getExportedSymbols(module);
+		if (outputs.exportFormat == "binary")
 		{
-			continue;
+			std::vector<uint8_t> exportBuffer;
+			writeBinarySymbolMap(exportBuffer, exportedSymbols);
+			std::ofstream exportStream(filename, std::ios::binary);
+			exportStream.write(reinterpret_cast<const char *>(exportBuffer.data()), exportBuffer.size());
 		}
+		else
+		{
+			std::ofstream exportStream(filename);
+			writeSymbolMap(exportStream, exportedSymbols);
+		}
+	}
 
-		// Try parse line
-		SymbolLocation sym;
-		std::string name;
-		if (!parseSymbol(line, sym, name))
+	if (!outputs.mapOutFilename.empty())
+	{
+		std::ofstream mapStream(getModuleOutputFilename(outputs.mapOutFilename, relFilename));
+		writeLayoutMap(mapStream, module);
+	}
+
+	if (!outputs.reportFilename.empty())
+	{
+		std::ofstream reportFile;
+		if (outputs.reportFilename != "-")
+		{
+			reportFile.open(getModuleOutputFilename(outputs.reportFilename, relFilename));
+		}
+		std::ostream &reportStream = outputs.reportFilename != "-" ? reportFile : std::cout;
+		if (outputs.reportFormat == "json")
+		{
+			writeReportJson(reportStream, module.report, outputs.reportTopSymbols);
+		}
+		else
 		{
-			std::cerr << "Invalid symbol: " << line << std::endl;
-			continue;
+			writeReportText(reportStream, module.report, outputs.reportTopSymbols);
 		}
-		outputMap[name] = sym;
 	}
 
-	return outputMap;
+	return true;
 }
 
-void writeModuleHeader(std::vector<uint8_t> &buffer,
-					   int version,
-					   int id,
-					   int sectionCount,
-					   int sectionInfoOffset,
-					   int totalBssSize,
-					   int relocationOffset,
-					   int importInfoOffset,
-					   int importInfoSize,
-					   int prologSection,
-					   int epilogSection,
-					   int unresolvedSection,
-					   int prologOffset,
-					   int epilogOffset,
-					   int unresolvedOffset,
-					   int maxAlign,
-					   int maxBssAlign,
-					   int fixedDataSize)
+// Loads the symbol files and converts every module, returns the exit code
+int convertModules(std::vector<ModuleJob> &jobs,
+				   const std::vector<std::string> &mapFilenames,
+				   const std::vector<SymbolRegion> &regions,
+				   int jobCount,
+				   const OutputOptions &outputs)
 {
-	save<uint32_t>(buffer, id);
-	save<uint32_t>(buffer, 0); // prev link
-	save<uint32_t>(buffer, 0); // next link
-	save<uint32_t>(buffer, sectionCount);
-	save<uint32_t>(buffer, sectionInfoOffset);
-	save<uint32_t>(buffer, 0); // name offset
-	save<uint32_t>(buffer, 0); // name size
-	save<uint32_t>(buffer, version); // version
-
-	save<uint32_t>(buffer, totalBssSize);
-	save<uint32_t>(buffer, relocationOffset);
-	save<uint32_t>(buffer, importInfoOffset);
-	save<uint32_t>(buffer, importInfoSize);
-	save<uint8_t>(buffer, prologSection);
-	save<uint8_t>(buffer, epilogSection);
-	save<uint8_t>(buffer, unresolvedSection);
-	save<uint8_t>(buffer, 0); // pad
-	save<uint32_t>(buffer, prologOffset);
-	save<uint32_t>(buffer, epilogOffset);
-	save<uint32_t>(buffer, unresolvedOffset);
-	if (version >= 2)
-	{
-		save<uint32_t>(buffer, maxAlign);
-		save<uint32_t>(buffer, maxBssAlign);
+	Arena symbolArena;
+	SymbolMap commonSymbolMap(symbolArena.getResource());
+	for (auto path : mapFilenames) {
+		TraceScope trace("Load symbol file", path);
+		MemoryPhaseScope memoryPhase(MemoryPhase::SymbolMaps);
+		loadSymbolMap(path, symbolArena, commonSymbolMap);
 	}
-	if (version >= 3)
+
+	// Region symbol files take precedence over the common ones
+	std::vector<SymbolMap> regionSymbolMaps;
+	for (const auto &region : regions)
 	{
-		save<uint32_t>(buffer, fixedDataSize);
+		SymbolMap &regionSymbolMap = regionSymbolMaps.emplace_back(symbolArena.getResource());
+		for (auto path : region.mapFilenames)
+		{
+			TraceScope trace("Load symbol file", path);
+			MemoryPhaseScope memoryPhase(MemoryPhase::SymbolMaps);
+			loadSymbolMap(path, symbolArena, regionSymbolMap);
+		}
+		regionSymbolMap.insert(commonSymbolMap.begin(), commonSymbolMap.end());
 	}
-}
 
-void writeSectionInfo(std::vector<uint8_t> &buffer, int offset, int size)
-{
-	save<uint32_t>(buffer, offset);
-	save<uint32_t>(buffer, size);
-}
+	std::vector<const SymbolMap *> dolSymbolMaps;
+	for (const auto &regionSymbolMap : regionSymbolMaps)
+	{
+		dolSymbolMaps.push_back(&regionSymbolMap);
+	}
 
-void writeImportInfo(std::vector<uint8_t> &buffer, int id, int offset)
-{
-	save<uint32_t>(buffer, id);
-	save<uint32_t>(buffer, offset);
-}
+	// Lay out every module, this does not depend on any other module
+	runParallel(static_cast<int>(jobs.size()), jobCount, [&](int index)
+	{
+		ModuleJob &job = jobs[index];
+		if (!loadModule(*job.module, job.elfFilename))
+		{
+			printf("Failed to load input file\n");
+			job.succeeded = false;
+			return;
+		}
+		if (job.module->options.dedupWeakSymbols || !job.module->options.dedupSymbols.empty())
+		{
+			redirectToDolCopies(*job.module, dolSymbolMaps);
+		}
+		layoutModule(*job.module);
+		if (!collectRelocations(*job.module))
+		{
+			job.succeeded = false;
+		}
+	});
+	for (const auto &job : jobs)
+	{
+		if (!job.succeeded)
+		{
+			return 1;
+		}
+	}
 
-void writeRelocation(std::vector<uint8_t> &buffer, int offset, int type, int section, uint32_t addend)
-{
-	save<uint16_t>(buffer, offset);
-	save<uint8_t>(buffer, type);
-	save<uint8_t>(buffer, section);
-	save<uint32_t>(buffer, addend);
-}
+	// Modules being converted together resolve against each other's final
+	// layout. Their exports take precedence over stale entries in symbol files.
+	if (jobs.size() > 1)
+	{
+		TraceScope trace("Share module exports");
+		std::map<std::string, int> exportingModules;
+		std::map<int, const ModuleJob *> modulesByID;
+		for (const auto &job : jobs)
+		{
+			int id = job.module->options.moduleID;
+			if (!modulesByID.emplace(id, &job).second)
+			{
+				printf("Modules '%s' and '%s' share ID %d\n",
+					   modulesByID[id]->elfFilename.c_str(),
+					   job.elfFilename.c_str(),
+					   id);
+				return 1;
+			}
 
-const std::vector<std::string> cRelSectionMask = {
-	".init",
-	".text",
-	".ctors",
-	".dtors",
-	".rodata",
-	".data",
-	".bss"
-};
+			for (const auto &symbol : getExportedSymbols(*job.module))
+			{
+				auto exporter = exportingModules.emplace(symbol.first, id);
+				if (!exporter.second)
+				{
+					printf("Symbol '%s' is defined by modules %d and %d, using module %d\n",
+						   symbol.first.c_str(),
+						   exporter.first->second,
+						   id,
+						   exporter.first->second);
+					continue;
+				}
+				std::string_view name = symbolArena.intern(symbol.first);
+				for (auto &regionSymbolMap : regionSymbolMaps)
+				{
+					regionSymbolMap.insert_or_assign(name, symbol.second);
+				}
+			}
+		}
+	}
+
+	// Resolve external symbols and write everything out, once per region
+	runParallel(static_cast<int>(jobs.size()), jobCount, [&](int index)
+	{
+		ModuleJob &job = jobs[index];
+		for (size_t i = 0; i < regions.size(); ++i)
+		{
+			TraceScope trace("Link region", regions[i].name);
+			if (!linkModule(*job.module, regionSymbolMaps[i]))
+			{
+				job.succeeded = false;
+				return;
+			}
+			if (!regions[i].name.empty() && job.module->report.unresolved)
+			{
+				printf("%d unresolved external symbols in region '%s'\n",
+					   job.module->report.unresolved,
+					   regions[i].name.c_str());
+			}
+			if (!writeModuleOutputs(*job.module, getRegionRelFilename(regions[i], job.relFilename), outputs))
+			{
+				job.succeeded = false;
+				return;
+			}
+		}
+	});
+	for (const auto &job : jobs)
+	{
+		if (!job.succeeded)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -195,8 +313,17 @@ int main(int argc, char **argv)
 	std::string lstFilename;
 	std::string relFilename = "";
 	std::vector<std::string> mapFilenames;
-	int moduleID = 33;
-	int relVersion = 3;
+	std::vector<std::string> moduleSpecs;
+	std::vector<std::string> regionSpecs;
+	std::string traceFilename;
+	std::string symbolOrderingFilename;
+	std::string lazyRuntimeFilename;
+	std::string exportTableFilename;
+	std::string exportHeaderFilename;
+	bool memoryStats = false;
+	int jobCount = 1;
+	ConversionOptions options;
+	OutputOptions outputs;
 
 	{
 		namespace po = boost::program_options;
@@ -205,10 +332,40 @@ int main(int argc, char **argv)
 		description.add_options()
 			("help", "Print help message")
 			("input-file,i", po::value(&elfFilename), "Input ELF filename (required)")
-			("symbol-file,s", po::value<std::vector<std::string>>()->multitoken(), "Input symbol file(s) (required)")
+			("symbol-file,s", po::value<std::vector<std::string>>()->multitoken(), "Input symbol file(s) (required unless region is given)")
 			("output-file,o", po::value(&relFilename), "Output REL filename")
-			("rel-id", po::value(&moduleID)->default_value(0x1000), "REL file ID")
-			("rel-version", po::value(&relVersion)->default_value(3), "REL file format version (1, 2, 3)");
+			("rel-id", po::value(&options.moduleID)->default_value(0x1000), "REL file ID")
+			("rel-version", po::value(&options.relVersion)->default_value(3), "REL file format version (1, 2, 3)")
+			("module", po::value(&moduleSpecs)->multitoken(), "Convert several modules that import from each other, given as ELF,ID[,REL] (replaces input-file, output-file and rel-id)")
+			("region", po::value(&regionSpecs)->multitoken(), "Link against several sets of symbol files and write a REL for each, given as NAME,REL,SYMBOLFILE[,SYMBOLFILE...] (REL may contain %, empty writes %.NAME.rel, symbol-file is shared by all regions)")
+			("jobs,j", po::value(&jobCount)->default_value(static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))), "Number of modules converted in parallel")
+			("icf", po::bool_switch(&options.foldIdentical), "Fold identical .text.* sections (function addresses may no longer be unique)")
+			("dedup-weak", po::bool_switch(&options.dedupWeakSymbols), "Use the dol's copy of weak functions and data the symbol files list in the dol, dropping the module's copy if nothing else refers to it")
+			("dedup-symbol", po::value(&options.dedupSymbols)->multitoken(), "Same as dedup-weak for these symbols regardless of their binding")
+			("relax-small-data", po::bool_switch(&options.relaxSmallData), "Rewrite lis/addi and lis/load pairs against dol small data to single r13 or r2 relative instructions")
+			("symbol-ordering-file", po::value(&symbolOrderingFilename), "Place the sections of the functions listed in this file first, one name per line, hottest first")
+			("symbol-ordering-align", po::value(&options.orderedSectionAlign)->default_value(0), "Align the sections placed by symbol-ordering-file to this many bytes, e.g. 32 for cache lines")
+			("coalesce-sections", po::bool_switch(&options.coalesceSections), "Place .text.*, .data.* and so on in one REL section each instead of writing a section table entry for every ELF section")
+			("lazy-imports", po::bool_switch(&options.lazyImports), "Call functions in other modules through stubs bound on first call instead of relocating every call site (needs the runtime from lazy-runtime-out)")
+			("lazy-runtime-out", po::value(&lazyRuntimeFilename), "Write the C source of the lazy import runtime to this file")
+			("init-section", po::value(&options.initSectionPatterns)->multitoken(), "Place sections matching these patterns (e.g. .text.init* .ctors) after all others and set fixedDataSize so they can be freed after _prolog along with the trimmed relocations")
+			("zero-data-to-bss", po::bool_switch(&options.zeroDataToBss), "Place .data sections that are all zero and have no relocations in bss, for objects in sections of their own (-fdata-sections)")
+			("merge-constants", po::bool_switch(&options.mergeConstants), "Deduplicate strings and constants in SHF_MERGE sections")
+			("keep-section", po::value(&options.keepSectionPatterns)->multitoken(), "Also place input sections matching these patterns in the REL (.name matches .name and .name.*, a trailing * matches any suffix)")
+			("relocation-cache", po::value(&options.relocationCacheFilename), "Reuse resolved relocations of unchanged sections from this file and update it")
+			("no-early-resolve", po::bool_switch()->notifier([&](bool set) { options.resolveEarly = !set; }), "Leave relocations within the module to OSLink where it supports them")
+			("report", po::value(&outputs.reportFilename), "Write a relocation cost report to this file (- for stdout)")
+			("report-format", po::value(&outputs.reportFormat)->default_value("text"), "Relocation report format (text, json)")
+			("report-top", po::value(&outputs.reportTopSymbols)->default_value(10), "Number of symbols listed by relocation fan-in")
+			("map-out", po::value(&outputs.mapOutFilename), "Write a map of where every input section and symbol was placed")
+			("export-symbols", po::value(&outputs.exportSymbolsFilename), "Write this module's global symbols as a symbol file for dependent modules")
+			("export-format", po::value(&outputs.exportFormat)->default_value("text"), "Exported symbol file format (text, binary)")
+			("export-table", po::value(&exportTableFilename), "Add a hash table of the global symbols listed in this file to the REL for lookups by name at runtime, one name per line")
+			("export-table-hashes", po::bool_switch(&options.exportTableHashesOnly), "Leave the names out of the export table, looking up a name that is not in it may then return another symbol")
+			("export-header-out", po::value(&exportHeaderFilename), "Write the C header looking up symbols in the export table to this file")
+			("relocations-out", po::value(&outputs.relocationsFilename), "Write the import and relocation tables to this file instead of the REL, the loader reads them into a scratch buffer and adds its offset from the module to the header's import and relocation offsets and to each import's offset before OSLinkFixed. Only for modules without relocations against other modules")
+			("trace", po::value(&traceFilename), "Write a timeline of the conversion in the Chrome trace event format")
+			("memory-stats", po::bool_switch(&memoryStats), "Print peak RSS and allocations by phase (allocations need a build with ELF2REL_MEMORY_STATS)");
 
 		po::positional_options_description positionals;
 		positionals.add("input-file", -1);
@@ -224,10 +381,12 @@ int main(int argc, char **argv)
 		po::notify(varMap);
 
 		if (varMap.count("help")
-			|| varMap.count("input-file") != 1
-			|| varMap.count("symbol-file") < 1
-			|| relVersion < 1
-			|| relVersion > 3)
+			|| varMap.count("input-file") + varMap.count("module") != 1
+			|| varMap.count("symbol-file") + varMap.count("region") < 1
+			|| options.relVersion < 1
+			|| options.relVersion > 3
+			|| (outputs.reportFormat != "text" && outputs.reportFormat != "json")
+			|| (outputs.exportFormat != "text" && outputs.exportFormat != "binary"))
 		{
 			std::cout << "Copyright 2019 Linus S. (aka PistonMiner)\n";
 			std::cout << "Modified by SeekyCT to support linking against other rels\n";
@@ -236,437 +395,143 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
-		mapFilenames = varMap["symbol-file"].as<std::vector<std::string>>();
+		if (varMap.count("symbol-file"))
+		{
+			mapFilenames = varMap["symbol-file"].as<std::vector<std::string>>();
+		}
 	}
 
-	if (relFilename == "")
+	if (!symbolOrderingFilename.empty() && !loadSymbolList(symbolOrderingFilename, options.symbolOrdering))
 	{
-		relFilename = elfFilename.substr(0, elfFilename.find_last_of('.')) + ".rel";
+		printf("Failed to read symbol ordering file '%s'\n", symbolOrderingFilename.c_str());
+		return 1;
 	}
-	
-	// Load input file
-	ELFIO::elfio inputElf;
-	if (!inputElf.load(elfFilename))
+	options.splitRelocations = !outputs.relocationsFilename.empty();
+	if (!exportTableFilename.empty() && !loadSymbolList(exportTableFilename, options.exportTableSymbols))
 	{
-		printf("Failed to load input file\n");
+		printf("Failed to read export table file '%s'\n", exportTableFilename.c_str());
 		return 1;
 	}
-	std::map<std::string, SymbolLocation> externalSymbolMap;
-	for (auto path : mapFilenames) {
-		auto syms = loadSymbolMap(path);
-		externalSymbolMap.merge(syms);
-	}
-
-	// Find special sections
-	ELFIO::section *symSection = nullptr;
-	std::vector<ELFIO::section *> relocationSections;
-	for (const auto &section : inputElf.sections)
+	if (options.orderedSectionAlign & (options.orderedSectionAlign - 1))
 	{
-		if (section->get_type() == SHT_SYMTAB)
-		{
-			symSection = section;
-		}
-		else if (section->get_type() == SHT_RELA)
-		{
-			relocationSections.emplace_back(section);
-		}
+		printf("Symbol ordering alignment %d is not a power of two\n", options.orderedSectionAlign);
+		return 1;
 	}
 
-	// Symbol accessor
-	ELFIO::symbol_section_accessor symbols(inputElf, symSection);
-
-	// Find prolog, epilog and unresolved
-	auto findSymbolSectionAndOffset = [&](const std::string &name, int &sectionIndex, int &offset)
+	if (!lazyRuntimeFilename.empty())
 	{
-		ELFIO::Elf64_Addr addr;
-		ELFIO::Elf_Xword size;
-		unsigned char bind;
-		unsigned char type;
-		ELFIO::Elf_Half section_index;
-		unsigned char other;
-		for (int i = 0; i < symbols.get_symbols_num(); ++i)
+		std::ofstream runtimeStream(lazyRuntimeFilename);
+		writeLazyBindingRuntime(runtimeStream);
+		if (!runtimeStream)
 		{
-			std::string symbolName;
-			if (symbols.get_symbol(static_cast<ELFIO::Elf_Xword>(i), symbolName, addr, size, bind, type, section_index, other))
-			{
-				if (symbolName == name)
-				{
-					sectionIndex = static_cast<int>(section_index);
-					offset = static_cast<int>(addr);
-					break;
-				}
-			}
+			printf("Failed to write lazy import runtime '%s'\n", lazyRuntimeFilename.c_str());
+			return 1;
 		}
-	};
-
-	int prologSectionIndex = 0, prologOffset = 0;
-	findSymbolSectionAndOffset("_prolog", prologSectionIndex, prologOffset);
-	int epilogSectionIndex = 0, epilogOffset = 0;
-	findSymbolSectionAndOffset("_epilog", epilogSectionIndex, epilogOffset);
-	int unresolvedSectionIndex = 0, unresolvedOffset = 0;
-	findSymbolSectionAndOffset("_unresolved", unresolvedSectionIndex, unresolvedOffset);
-
-	std::vector<uint8_t> outputBuffer;
-	// Dummy values for header until offsets are determined
-	writeModuleHeader(outputBuffer, relVersion, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-	int sectionInfoOffset = outputBuffer.size();
-	for (int i = 0; i < inputElf.sections.size(); ++i)
-	{
-		writeSectionInfo(outputBuffer, 0, 0);
 	}
 
-	// Write sections
-	std::vector<uint8_t> sectionInfoBuffer;
-	std::map<ELFIO::section *, int> writtenSections;
-	int totalBssSize = 0;
-	int maxAlign = 2;
-	int maxBssAlign = 2;
-	for (const auto &section : inputElf.sections)
-	{
-		// Should keep?
-		if (std::find_if(cRelSectionMask.begin(),
-						  cRelSectionMask.end(),
-						  [&](const std::string &val)
-		{
-			return val == section->get_name()
-				   || section->get_name().find(val + ".") == 0;
-		}) != cRelSectionMask.end())
-		{
-			// BSS?
-			if (section->get_type() == SHT_NOBITS)
-			{
-				// Update max alignment
-				int align = static_cast<int>(section->get_addr_align());
-				maxBssAlign = std::max(maxBssAlign, align);
-
-				int size = static_cast<int>(section->get_size());
-				totalBssSize += size;
-				writeSectionInfo(sectionInfoBuffer, 0, size);
-			}
-			else
-			{
-				// Update max alignment (minimum 2, low offset bit is used for exec flag)
-				int align = std::max(static_cast<int>(section->get_addr_align()), 2);
-				maxAlign = std::max(maxAlign, align);
-
-				// Write padding
-				int requiredPadding = ((outputBuffer.size() + align - 1) & ~(align - 1)) - outputBuffer.size();
-				for (int i = 0; i < requiredPadding; ++i)
-				{
-					save<uint8_t>(outputBuffer, 0);
-				}
-
-				int offset = outputBuffer.size();
-
-				int encodedOffset = offset;
-				// Mark executable sections
-				if (section->get_flags() & SHF_EXECINSTR)
-				{
-					encodedOffset |= 1;
-				}
-				writeSectionInfo(sectionInfoBuffer, encodedOffset, static_cast<int>(section->get_size()));
-				std::vector<uint8_t> sectionData(section->get_data(), section->get_data() + section->get_size());
-				outputBuffer.insert(outputBuffer.end(), sectionData.begin(), sectionData.end());
-
-				writtenSections[section] = offset;
-			}
-		}
-		else
-		{
-			// Section was removed
-			writeSectionInfo(sectionInfoBuffer, 0, 0);
-		}
-	}
-	// Fill in section info in main buffer
-	std::copy(sectionInfoBuffer.begin(), sectionInfoBuffer.end(), outputBuffer.begin() + sectionInfoOffset);
-
-	// Find all relocations
-	struct Relocation
-	{
-		uint32_t moduleID; // target module
-		uint32_t section;
-		uint32_t offset;
-		uint8_t targetSection;  // target symbol
-		uint32_t addend;
-		uint8_t type;
-	};
-	std::deque<Relocation> allRelocations;
-	for (const auto &section : relocationSections)
-	{
-		int relocatedSectionIndex = section->get_info();
-		ELFIO::section *relocatedSection = inputElf.sections[relocatedSectionIndex];
-		// Only relocate sections that were written
-		if (writtenSections.find(relocatedSection) != writtenSections.end())
+	if (!exportHeaderFilename.empty())
+	{
+		std::ofstream headerStream(exportHeaderFilename);
+		writeExportLookupHeader(headerStream);
+		if (!headerStream)
 		{
-			ELFIO::relocation_section_accessor relocations(inputElf, section);
-			// #todo-elf2rel: Process relocations
-			for (int i = 0; i < relocations.get_entries_num(); ++i)
-			{
-				ELFIO::Elf64_Addr offset;
-				ELFIO::Elf_Word symbol;
-				ELFIO::Elf_Word type;
-				ELFIO::Elf_Sxword addend;
-				relocations.get_entry(i, offset, symbol, type, addend);
-
-				// Ignore R_PPC_NONE
-				if (type == R_PPC_NONE)
-					continue;
-
-				ELFIO::Elf_Xword size;
-				unsigned char bind;
-				unsigned char symbolType;
-				ELFIO::Elf_Half sectionIndex;
-				unsigned char other;
-				std::string symbolName;
-				ELFIO::Elf64_Addr symbolValue;
-				if (!symbols.get_symbol(symbol, symbolName, symbolValue,
-										size, bind, symbolType, sectionIndex, other))
-				{
-					printf("Unable to find symbol %u in symbol table!\n", static_cast<uint32_t>(symbol));
-					return 1;
-				}
-
-				// Add relocation to list
-				bool resolved = false;
-				Relocation rel;
-				rel.section = relocatedSectionIndex;
-				rel.offset = static_cast<uint32_t>(offset);
-				rel.type = type;
-				if (sectionIndex)
-				{
-					// Self-relocation
-					resolved = true;
-
-					rel.moduleID = moduleID;
-					rel.targetSection = static_cast<uint8_t>(sectionIndex);
-					rel.addend = static_cast<uint32_t>(addend + symbolValue);
-
-					ELFIO::section *targetSection = inputElf.sections[rel.targetSection];
-					if (writtenSections.find(targetSection) == writtenSections.end() && targetSection->get_type() != SHT_NOBITS)
-					{
-						printf("Relocation from section '%s' offset %llx against symbol '%s' in unwritten section '%s'\n",
-							   relocatedSection->get_name().c_str(),
-							   offset,
-							   symbolName.c_str(),
-							   targetSection->get_name().c_str());
-					}
-				}
-				else
-				{
-					// Symbol is unknown, check if it's an external known symbol
-					auto it = externalSymbolMap.find(symbolName);
-					if (it != externalSymbolMap.end())
-					{
-						// Known external!
-						resolved = true;
-						rel.moduleID = it->second.moduleId;
-						rel.targetSection = it->second.targetSection;
-						rel.addend = static_cast<uint32_t>(addend + it->second.addr);
-					}
-				}
-
-				if (resolved)
-				{
-					allRelocations.emplace_back(rel);
-				}
-				else
-				{
-					printf("Unresolved external symbol '%s'\n", symbolName.c_str());
-				}
-			}
+			printf("Failed to write export lookup header '%s'\n", exportHeaderFilename.c_str());
+			return 1;
 		}
 	}
 
-	// Returns whether a module should be placed at the end of relocations for trimming
-	auto getModuleDelay = [moduleID](uint32_t id)
+	// Collect symbol file sets to link against
+	std::vector<SymbolRegion> regions;
+	for (const auto &spec : regionSpecs)
 	{
-		if (id == 0 || id == moduleID)
+		std::vector<std::string> parts;
+		boost::split(parts, spec, boost::is_any_of(","));
+		if (parts.size() < 3 || parts[0].empty())
 		{
+			printf("Invalid region '%s', expected NAME,REL,SYMBOLFILE[,SYMBOLFILE...]\n", spec.c_str());
 			return 1;
 		}
-		else
-		{
-			return 0;
-		}
-	};
-
-	// Sort relocations
-	std::sort(allRelocations.begin(), allRelocations.end(),
-			  [&](const Relocation &left, const Relocation &right)
+		SymbolRegion region;
+		region.name = parts[0];
+		region.relFilename = parts[1];
+		region.mapFilenames.assign(parts.begin() + 2, parts.end());
+		regions.emplace_back(std::move(region));
+	}
+	if (regions.empty())
 	{
-		// Relocations against the dol & this module need to be placed last for trimming with OSLinkFixed
-		int delayLeft = getModuleDelay(left.moduleID);
-		int delayRight = getModuleDelay(right.moduleID);
-		if (delayLeft != delayRight)
-		{
-			return delayLeft < delayRight;
-		}
-		
-		return std::tuple<uint32_t, uint32_t, uint32_t>(left.moduleID, left.section, left.offset)
-			   < std::tuple<uint32_t, uint32_t, uint32_t>(right.moduleID, right.section, right.offset);
-	});
+		regions.emplace_back();
+	}
 
-	// Count modules
-	int importCount = 0;
-	int lastModuleID = -1;
-	for (const auto &rel : allRelocations)
+	// Collect modules to convert
+	std::vector<ModuleJob> jobs;
+	if (moduleSpecs.empty())
 	{
-		if (lastModuleID != rel.moduleID)
+		if (relFilename == "")
 		{
-			lastModuleID = rel.moduleID;
-			++importCount;
+			relFilename = elfFilename.substr(0, elfFilename.find_last_of('.')) + ".rel";
 		}
-	}
 
-	// Write padding for imports
-	int requiredPadding = 8 - outputBuffer.size() % 8;
-	for (int i = 0; i < requiredPadding; ++i)
-	{
-		save<uint8_t>(outputBuffer, 0);
+		ModuleJob job;
+		job.elfFilename = elfFilename;
+		job.relFilename = relFilename;
+		job.module = std::make_unique<RelModule>();
+		job.module->options = options;
+		jobs.emplace_back(std::move(job));
 	}
-
-	// Write dummy imports
-	int importInfoOffset = outputBuffer.size();
-	for (int i = 0; i < importCount; ++i)
+	else
 	{
-		writeImportInfo(outputBuffer, 0, 0);
-	}
-
-	// Write out relocations
-	int relocationOffset = outputBuffer.size();
-
-	std::vector<uint8_t> importInfoBuffer;
-	int currentModuleID = -1;
-	int currentSectionIndex = -1;
-	int currentOffset = 0;
-	int fixedRelocationsSize = 0;
-	while (!allRelocations.empty())
-	{
-		Relocation nextRel = allRelocations.front();
-		allRelocations.pop_front();
-		
-		// Resolve early if possible
-		if (nextRel.moduleID == moduleID && (nextRel.type == R_PPC_REL24 || nextRel.type == R_PPC_REL32))
+		for (const auto &spec : moduleSpecs)
 		{
-			int offset = writtenSections.at(inputElf.sections[nextRel.section]) + nextRel.offset;
-			int delta = writtenSections.at(inputElf.sections[nextRel.targetSection]) + nextRel.addend - offset;
-			std::vector<uint8_t> instructionBuffer(outputBuffer.begin() + offset, outputBuffer.begin() + offset + 4);
-			uint32_t patchedData;
-			load(instructionBuffer, patchedData);
-			
-			if (nextRel.type == R_PPC_REL24)
+			std::vector<std::string> parts;
+			boost::split(parts, spec, boost::is_any_of(","));
+			ModuleJob job;
+			job.module = std::make_unique<RelModule>();
+			job.module->options = options;
+			try
 			{
-				patchedData |= (delta & 0x03FFFFFC);
+				job.module->options.moduleID = std::stoi(parts.at(1), nullptr, 0);
 			}
-			else if (nextRel.type == R_PPC_REL32)
-			{
-				patchedData = delta;
-			}
-			
-			save(instructionBuffer, patchedData);
-			std::copy(instructionBuffer.begin(), instructionBuffer.end(), outputBuffer.begin() + offset);
-
-			continue;
-		}
-
-		// Change module if necessary
-		if (currentModuleID != nextRel.moduleID)
-		{
-			// Not first module?
-			if (currentModuleID != -1)
+			catch (std::exception &)
 			{
-				writeRelocation(outputBuffer, 0, R_DOLPHIN_END, 0, 0);
+				printf("Invalid module '%s', expected ELF,ID[,REL]\n", spec.c_str());
+				return 1;
 			}
-
-			// If the next module ID was forced to the back and the current one wasn't,
-			// then this is the end of the relocations included in the fixed size
-			if (getModuleDelay(nextRel.moduleID) > getModuleDelay(currentModuleID))
+			job.elfFilename = parts[0];
+			job.relFilename = parts.size() > 2 ? parts[2] : job.elfFilename.substr(0, job.elfFilename.find_last_of('.')) + ".rel";
+			if (!options.relocationCacheFilename.empty())
 			{
-				fixedRelocationsSize = outputBuffer.size() - relocationOffset;
+				job.module->options.relocationCacheFilename = getModuleOutputFilename(options.relocationCacheFilename, job.relFilename);
 			}
-
-			currentModuleID = nextRel.moduleID;
-			currentSectionIndex = -1;
-			writeImportInfo(importInfoBuffer, currentModuleID, outputBuffer.size());
-		}
-
-		// Change section if necessary
-		if (currentSectionIndex != nextRel.section)
-		{
-			currentSectionIndex = nextRel.section;
-			currentOffset = 0;
-			writeRelocation(outputBuffer, 0, R_DOLPHIN_SECTION, currentSectionIndex, 0);
+			jobs.emplace_back(std::move(job));
 		}
+	}
 
-		// Get into range of the target
-		int targetDelta = nextRel.offset - currentOffset;
-		while (targetDelta > 0xFFFF)
-		{
-			writeRelocation(outputBuffer, 0xFFFF, R_DOLPHIN_NOP, 0, 0);
-			targetDelta -= 0xFFFF;
-		}
-		
-		// #todo-elf2rel: Add runtime unresolved symbol handling here
-		// At this point, only symbols that OSLink can handle should remain
-		switch (nextRel.type)
+	if (jobs.size() > 1 && !options.relocationCacheFilename.empty() && options.relocationCacheFilename.find('%') == std::string::npos)
+	{
+		printf("Relocation cache '%s' must contain %% when converting several modules\n", options.relocationCacheFilename.c_str());
+		return 1;
+	}
+	for (const std::string *filename : { &outputs.reportFilename, &outputs.mapOutFilename, &outputs.exportSymbolsFilename, &outputs.relocationsFilename })
+	{
+		if (jobs.size() * regions.size() > 1 && !filename->empty() && *filename != "-" && filename->find('%') == std::string::npos)
 		{
-		case R_PPC_NONE:
-		case R_PPC_ADDR32:
-		case R_PPC_ADDR24:
-		case R_PPC_ADDR16:
-		case R_PPC_ADDR16_LO:
-		case R_PPC_ADDR16_HI:
-		case R_PPC_ADDR16_HA:
-		case R_PPC_ADDR14:
-		case R_PPC_ADDR14_BRTAKEN:
-		case R_PPC_ADDR14_BRNKTAKEN:
-		case R_PPC_REL24:
-		case R_DOLPHIN_NOP:
-		case R_DOLPHIN_SECTION:
-		case R_DOLPHIN_END:
-			break;
-		default:
-			printf("Unsupported relocation type %d\n", nextRel.type);
-			break;
+			printf("Output '%s' is written per module and must contain %% when converting several modules or regions\n", filename->c_str());
+			return 1;
 		}
-
-		writeRelocation(outputBuffer, targetDelta, nextRel.type, nextRel.targetSection, nextRel.addend);
-		currentOffset = nextRel.offset;
 	}
-	writeRelocation(outputBuffer, 0, R_DOLPHIN_END, 0, 0);
 
-	// If the final module referenced isn't forced to the back, then all
-	// relocations must be included in the fixed size
-	if (getModuleDelay(currentModuleID) == 0)
+	if (!traceFilename.empty())
 	{
-		fixedRelocationsSize = outputBuffer.size() - relocationOffset;
+		enableTrace();
 	}
-
-	// Write final import infos
-	int importInfoSize = importInfoBuffer.size();
-	std::copy(importInfoBuffer.begin(), importInfoBuffer.end(), outputBuffer.begin() + importInfoOffset);
-		
-	// Write final header
-	std::vector<uint8_t> headerBuffer;
-	writeModuleHeader(headerBuffer,
-					  relVersion,
-					  moduleID,
-					  inputElf.sections.size(),
-					  sectionInfoOffset,
-					  totalBssSize,
-					  relocationOffset,
-					  importInfoOffset,
-					  importInfoSize,
-					  prologSectionIndex, epilogSectionIndex, unresolvedSectionIndex,
-					  prologOffset, epilogOffset, unresolvedOffset,
-					  maxAlign,
-					  maxBssAlign,
-					  relocationOffset + fixedRelocationsSize);
-	std::copy(headerBuffer.begin(), headerBuffer.end(), outputBuffer.begin());
-
-	// Write final REL file
-	std::ofstream outputStream(relFilename, std::ios::binary);
-	outputStream.write(reinterpret_cast<const char *>(outputBuffer.data()), outputBuffer.size());
-	
-	return 0;
+	int result = convertModules(jobs, mapFilenames, regions, jobCount, outputs);
+	if (!traceFilename.empty() && !writeTrace(traceFilename))
+	{
+		printf("Failed to write trace '%s'\n", traceFilename.c_str());
+	}
+	if (memoryStats)
+	{
+		writeMemoryStats(std::cout);
+	}
+	return result;
 }
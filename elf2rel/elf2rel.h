@@ -22,6 +22,9 @@ enum RelRelocationType
 	R_PPC_REL14,
 
 	R_PPC_REL32 = 26,
+	R_PPC_SDAREL16 = 32,
+
+	R_PPC_EMB_SDA21 = 109,
 
 	R_DOLPHIN_NOP = 201,
 	R_DOLPHIN_SECTION,
@@ -46,4 +49,15 @@ void load(std::vector<uint8_t> &buffer, T &value)
 		value |= static_cast<T>(buffer.front()) << ((i - 1) * 8);
 		buffer.erase(buffer.begin());
 	}
-}
\ No newline at end of file
+}
+
+template<typename T>
+T loadAt(const std::vector<uint8_t> &buffer, std::size_t offset)
+{
+	T value = 0;
+	for (std::size_t i = 0; i < sizeof(T); ++i)
+	{
+		value = static_cast<T>(value << 8) | static_cast<T>(buffer[offset + i]);
+	}
+	return value;
+}
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "exports.h"
+
+#include "elf2rel.h"
+
+const int cExportTableHeaderSize = 8;
+const int cExportSlotSize = 16;
+
+uint32_t hashExportName(std::string_view name)
+{
+	uint32_t hash = 2166136261u;
+	for (char c : name)
+	{
+		hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+	}
+	return hash;
+}
+
+std::vector<uint8_t> buildExportTable(const std::vector<std::pair<std::string, SymbolLocation>> &symbols, bool includeNames)
+{
+	uint32_t slotCount = 1;
+	while (slotCount < symbols.size() * 2)
+	{
+		slotCount *= 2;
+	}
+
+	std::vector<const std::pair<std::string, SymbolLocation> *> slots(slotCount);
+	for (const auto &symbol : symbols)
+	{
+		uint32_t slot = hashExportName(symbol.first) & (slotCount - 1);
+		while (slots[slot])
+		{
+			slot = (slot + 1) & (slotCount - 1);
+		}
+		slots[slot] = &symbol;
+	}
+
+	std::vector<uint8_t> buffer;
+	std::vector<uint8_t> names;
+	int namesOffset = cExportTableHeaderSize + static_cast<int>(slotCount) * cExportSlotSize;
+	save<uint32_t>(buffer, cExportTableMagic);
+	save<uint32_t>(buffer, slotCount);
+	for (const auto *symbol : slots)
+	{
+		if (!symbol)
+		{
+			for (int i = 0; i < cExportSlotSize; ++i)
+			{
+				save<uint8_t>(buffer, 0);
+			}
+			continue;
+		}
+		save<uint32_t>(buffer, hashExportName(symbol->first));
+		save<uint32_t>(buffer, includeNames ? namesOffset + static_cast<uint32_t>(names.size()) : 0);
+		save<uint32_t>(buffer, symbol->second.targetSection);
+		save<uint32_t>(buffer, symbol->second.addr);
+		if (includeNames)
+		{
+			names.insert(names.end(), symbol->first.begin(), symbol->first.end());
+			names.push_back(0);
+		}
+	}
+	buffer.insert(buffer.end(), names.begin(), names.end());
+	while (buffer.size() % 4 != 0)
+	{
+		save<uint8_t>(buffer, 0);
+	}
+	return buffer;
+}
+
+void writeExportLookupHeader(std::ostream &stream)
+{
+	stream << R"header(/* Lookup of symbols in the export table elf2rel --export-table writes into
+ * a REL, for modules linked by OSLink. The table is the module's last
+ * section. */
+
+#ifndef ELF2REL_EXPORTS_H
+#define ELF2REL_EXPORTS_H
+
+#include <string.h>
+
+#define ELF2REL_EXPORT_TABLE_MAGIC 0x45325258
+
+typedef struct ElfToRelExport
+{
+	unsigned int hash;
+	unsigned int nameOffset;
+	unsigned int section;
+	unsigned int offset;
+} ElfToRelExport;
+
+typedef struct ElfToRelExportTable
+{
+	unsigned int magic;
+	unsigned int slotCount;
+	ElfToRelExport slots[1];
+} ElfToRelExportTable;
+
+static inline unsigned int elf2relHashName(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	while (*name)
+	{
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	}
+	return hash;
+}
+
+/* Address of a symbol exported by a linked module, given its OSModuleInfo,
+ * or 0. Without names in the table, names that are not exported may return
+ * another symbol with the same hash. */
+static inline void *elf2relFindExport(const void *moduleInfo, const char *name)
+{
+	const unsigned int *module = (const unsigned int *)moduleInfo;
+	unsigned int numSections = module[3];
+	const unsigned int *sectionInfo = (const unsigned int *)module[4];
+	const ElfToRelExportTable *table;
+	unsigned int hash, mask, i;
+
+	if (numSections == 0 || sectionInfo[(numSections - 1) * 2 + 1] == 0)
+	{
+		return 0;
+	}
+	table = (const ElfToRelExportTable *)(sectionInfo[(numSections - 1) * 2] & ~1u);
+	if (table->magic != ELF2REL_EXPORT_TABLE_MAGIC)
+	{
+		return 0;
+	}
+
+	hash = elf2relHashName(name);
+	mask = table->slotCount - 1;
+	for (i = hash & mask; table->slots[i].section != 0; i = (i + 1) & mask)
+	{
+		const ElfToRelExport *slot = &table->slots[i];
+		if (slot->hash == hash
+			&& (slot->nameOffset == 0 || strcmp((const char *)table + slot->nameOffset, name) == 0))
+		{
+			return (void *)((sectionInfo[slot->section * 2] & ~1u) + slot->offset);
+		}
+	}
+	return 0;
+}
+
+#endif
+)header";
+}
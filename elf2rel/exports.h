@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "symbols.h"
+
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+const uint32_t cExportTableMagic = 0x45325258; // 'E2RX'
+
+// FNV-1a with 32 bits, as computed by the lookup header
+uint32_t hashExportName(std::string_view name);
+
+// Export tables start with the magic and the slot count, a power of two at
+// least twice the symbol count. Each slot holds the name hash, the offset of
+// the name from the start of the table (0 without names), and the REL section
+// and offset of the symbol. Empty slots have section 0. Symbols are placed at
+// the first free slot from their hash, the names follow the slots.
+std::vector<uint8_t> buildExportTable(const std::vector<std::pair<std::string, SymbolLocation>> &symbols, bool includeNames);
+
+// Header-only C lookup of symbols in a linked module's export table
+void writeExportLookupHeader(std::ostream &stream);
@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "lazy.h"
+
+#include "elf2rel.h"
+
+// Stub table header, then the code branching to cLazyBindSymbol
+const int cLazyHeaderSize = 8;
+const int cLazyCodeSize = 24;
+const int cLazyImportSize = 12;
+const int cLazyEntrySize = 8;
+
+// Instructions written into the stub table
+const uint32_t cMflrR0 = 0x7C0802A6;
+const uint32_t cMtlrR0 = 0x7C0803A6;
+const uint32_t cMflrR12 = 0x7D8802A6;
+const uint32_t cBranch = 0x48000000;
+const uint32_t cBranchLink = 0x48000001;
+const uint32_t cAddiR12R12 = 0x398C0000;
+const uint32_t cLiR11 = 0x39600000;
+
+static uint32_t encodeBranch(int from, int to, uint32_t opcode = cBranch)
+{
+	return opcode | ((to - from) & 0x03FFFFFC);
+}
+
+static int getLazyImportsOffset()
+{
+	return cLazyHeaderSize + cLazyCodeSize;
+}
+
+static int getLazyEntryOffset(size_t importCount, size_t index)
+{
+	return getLazyStubOffset(importCount, importCount) + static_cast<int>(index) * cLazyEntrySize;
+}
+
+int getLazyStubOffset(size_t importCount, size_t index)
+{
+	return getLazyImportsOffset() + static_cast<int>(importCount) * cLazyImportSize + static_cast<int>(index) * 4;
+}
+
+int getLazyBindBranchOffset()
+{
+	return cLazyHeaderSize + cLazyCodeSize - 4;
+}
+
+std::vector<uint8_t> buildLazyStubTable(const std::vector<LazyImport> &imports)
+{
+	std::vector<uint8_t> buffer;
+	save<uint32_t>(buffer, static_cast<uint32_t>(imports.size()));
+	save<uint32_t>(buffer, getLazyStubOffset(imports.size(), 0));
+
+	// Finds the table from the return address of a branch to the next
+	// instruction, keeping the caller's return address in lr
+	save<uint32_t>(buffer, cMflrR0);
+	save<uint32_t>(buffer, cBranchLink | 4);
+	save<uint32_t>(buffer, cMflrR12);
+	save<uint32_t>(buffer, cMtlrR0);
+	save<uint32_t>(buffer, cAddiR12R12 | (static_cast<uint32_t>(-(cLazyHeaderSize + 8)) & 0xFFFF));
+	save<uint32_t>(buffer, cBranch);
+
+	for (const auto &import : imports)
+	{
+		save<uint32_t>(buffer, import.moduleID);
+		save<uint32_t>(buffer, import.section);
+		save<uint32_t>(buffer, import.offset);
+	}
+	for (size_t i = 0; i < imports.size(); ++i)
+	{
+		save<uint32_t>(buffer, encodeBranch(getLazyStubOffset(imports.size(), i), getLazyEntryOffset(imports.size(), i)));
+	}
+	for (size_t i = 0; i < imports.size(); ++i)
+	{
+		int entryOffset = getLazyEntryOffset(imports.size(), i);
+		save<uint32_t>(buffer, cLiR11 | static_cast<uint32_t>(i));
+		save<uint32_t>(buffer, encodeBranch(entryOffset + 4, cLazyHeaderSize));
+	}
+	return buffer;
+}
+
+void writeLazyBindingRuntime(std::ostream &stream)
+{
+	stream << R"runtime(/* Lazy binding runtime for modules converted with elf2rel --lazy-imports.
+ * Compile it into the dol, or into every module using lazy imports. Calls
+ * into other modules go through a stub, which is rewritten to branch to the
+ * target the first time it is called.
+ *
+ * Stubs are not reset when the target module is unlinked, unlink the modules
+ * calling it as well. */
+
+typedef struct ElfToRelLazyImport
+{
+	unsigned int moduleID;
+	unsigned int section;
+	unsigned int offset;
+} ElfToRelLazyImport;
+
+typedef struct ElfToRelStubTable
+{
+	unsigned int importCount;
+	unsigned int stubsOffset;
+	unsigned int code[6];
+	ElfToRelLazyImport imports[1];
+} ElfToRelStubTable;
+
+/* Start of OSModuleInfo */
+typedef struct ElfToRelModuleInfo
+{
+	unsigned int id;
+	struct ElfToRelModuleInfo *next;
+	struct ElfToRelModuleInfo *prev;
+	unsigned int numSections;
+	unsigned int *sectionInfo;
+} ElfToRelModuleInfo;
+
+/* Head of the list of linked modules */
+#define ELF2REL_MODULE_LIST (*(ElfToRelModuleInfo **)0x800030C8)
+
+void DCFlushRange(void *addr, unsigned int nBytes);
+void ICInvalidateRange(void *addr, unsigned int nBytes);
+
+/* Called with the arguments of calls into modules that are not linked,
+ * define it to report them */
+__attribute__((weak)) void __elf2rel_lazy_unresolved(void)
+{
+	for (;;)
+	{
+	}
+}
+
+void *__elf2rel_lazy_resolve(ElfToRelStubTable *table, unsigned int index)
+{
+	const ElfToRelLazyImport *import = &table->imports[index];
+	unsigned int *stub = (unsigned int *)((char *)table + table->stubsOffset) + index;
+	ElfToRelModuleInfo *module;
+	unsigned int target;
+
+	for (module = ELF2REL_MODULE_LIST; module; module = module->next)
+	{
+		if (module->id == import->moduleID)
+		{
+			break;
+		}
+	}
+	if (!module || import->section >= module->numSections)
+	{
+		return (void *)__elf2rel_lazy_unresolved;
+	}
+
+	target = (module->sectionInfo[import->section * 2] & ~1u) + import->offset;
+	*stub = 0x48000000 | ((target - (unsigned int)stub) & 0x03FFFFFC);
+	DCFlushRange(stub, 4);
+	ICInvalidateRange(stub, 4);
+	return (void *)target;
+}
+
+/* Entered from the stub table with the import index in r11 and the table in
+ * r12, keeps the arguments of the call and continues at the target */
+__asm__(
+	"	.text\n"
+	"	.globl __elf2rel_lazy_bind\n"
+	"__elf2rel_lazy_bind:\n"
+	"	stwu 1, -112(1)\n"
+	"	mflr 0\n"
+	"	stw 0, 116(1)\n"
+	"	mfcr 0\n"
+	"	stw 0, 104(1)\n"
+	"	stw 3, 8(1)\n"
+	"	stw 4, 12(1)\n"
+	"	stw 5, 16(1)\n"
+	"	stw 6, 20(1)\n"
+	"	stw 7, 24(1)\n"
+	"	stw 8, 28(1)\n"
+	"	stw 9, 32(1)\n"
+	"	stw 10, 36(1)\n"
+	"	stfd 1, 40(1)\n"
+	"	stfd 2, 48(1)\n"
+	"	stfd 3, 56(1)\n"
+	"	stfd 4, 64(1)\n"
+	"	stfd 5, 72(1)\n"
+	"	stfd 6, 80(1)\n"
+	"	stfd 7, 88(1)\n"
+	"	stfd 8, 96(1)\n"
+	"	mr 3, 12\n"
+	"	mr 4, 11\n"
+	"	bl __elf2rel_lazy_resolve\n"
+	"	mtctr 3\n"
+	"	lwz 3, 8(1)\n"
+	"	lwz 4, 12(1)\n"
+	"	lwz 5, 16(1)\n"
+	"	lwz 6, 20(1)\n"
+	"	lwz 7, 24(1)\n"
+	"	lwz 8, 28(1)\n"
+	"	lwz 9, 32(1)\n"
+	"	lwz 10, 36(1)\n"
+	"	lfd 1, 40(1)\n"
+	"	lfd 2, 48(1)\n"
+	"	lfd 3, 56(1)\n"
+	"	lfd 4, 64(1)\n"
+	"	lfd 5, 72(1)\n"
+	"	lfd 6, 80(1)\n"
+	"	lfd 7, 88(1)\n"
+	"	lfd 8, 96(1)\n"
+	"	lwz 0, 104(1)\n"
+	"	mtcrf 0xff, 0\n"
+	"	lwz 0, 116(1)\n"
+	"	mtlr 0\n"
+	"	addi 1, 1, 112\n"
+	"	bctr\n");
+)runtime";
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+// Entry point of the lazy binding runtime, stubs branch to it on first use
+const char *const cLazyBindSymbol = "__elf2rel_lazy_bind";
+
+// The stub table has a 16 bit field for the import index
+const int cMaxLazyImports = 0x8000;
+
+// Function in another module, called through a stub
+struct LazyImport
+{
+	uint32_t moduleID;
+	uint32_t section; // REL section of the target module
+	uint32_t offset;
+
+	bool operator<(const LazyImport &other) const
+	{
+		return moduleID != other.moduleID ? moduleID < other.moduleID
+			: section != other.section ? section < other.section
+			: offset < other.offset;
+	}
+};
+
+// Stub tables start with the import count and the offset of the stubs,
+// followed by the code shared by all stubs, the imports, one branch per
+// import and the code loading the import index. Call sites branch to the
+// stub, which the runtime rewrites to branch to the target on first use.
+std::vector<uint8_t> buildLazyStubTable(const std::vector<LazyImport> &imports);
+int getLazyStubOffset(size_t importCount, size_t index);
+// Branch to cLazyBindSymbol, left for OSLink or patched when the module
+// defines it
+int getLazyBindBranchOffset();
+
+// C source of the runtime, for the dol or each module using lazy imports
+void writeLazyBindingRuntime(std::ostream &stream);
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "memstats.h"
+
+#include <cstdio>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifdef ELF2REL_MEMORY_STATS
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+struct PhaseCounters
+{
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> bytes;
+};
+
+static PhaseCounters phaseCounters[static_cast<int>(MemoryPhase::Count)];
+static thread_local MemoryPhase currentPhase = MemoryPhase::Other;
+
+MemoryPhaseScope::MemoryPhaseScope(MemoryPhase phase)
+	: previous(currentPhase)
+{
+	currentPhase = phase;
+}
+
+MemoryPhaseScope::~MemoryPhaseScope()
+{
+	currentPhase = previous;
+}
+
+uint64_t getAllocationCount()
+{
+	uint64_t count = 0;
+	for (const auto &counters : phaseCounters)
+	{
+		count += counters.allocations.load(std::memory_order_relaxed);
+	}
+	return count;
+}
+
+uint64_t getAllocatedBytes()
+{
+	uint64_t bytes = 0;
+	for (const auto &counters : phaseCounters)
+	{
+		bytes += counters.bytes.load(std::memory_order_relaxed);
+	}
+	return bytes;
+}
+
+static void *allocate(std::size_t size, std::size_t alignment)
+{
+	PhaseCounters &counters = phaseCounters[static_cast<int>(currentPhase)];
+	counters.allocations.fetch_add(1, std::memory_order_relaxed);
+	counters.bytes.fetch_add(size, std::memory_order_relaxed);
+
+	if (size == 0)
+	{
+		size = 1;
+	}
+	void *memory;
+	if (alignment <= alignof(std::max_align_t))
+	{
+		memory = std::malloc(size);
+	}
+	else
+	{
+#ifdef _MSC_VER
+		memory = _aligned_malloc(size, alignment);
+#else
+		memory = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+	}
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+static void deallocate(void *memory, [[maybe_unused]] std::size_t alignment)
+{
+#ifdef _MSC_VER
+	if (alignment > alignof(std::max_align_t))
+	{
+		_aligned_free(memory);
+		return;
+	}
+#endif
+	std::free(memory);
+}
+
+void *operator new(std::size_t size) { return allocate(size, 0); }
+void *operator new[](std::size_t size) { return allocate(size, 0); }
+void *operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+void *operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, static_cast<std::size_t>(alignment)); }
+void operator delete(void *memory) noexcept { deallocate(memory, 0); }
+void operator delete[](void *memory) noexcept { deallocate(memory, 0); }
+void operator delete(void *memory, std::size_t) noexcept { deallocate(memory, 0); }
+void operator delete[](void *memory, std::size_t) noexcept { deallocate(memory, 0); }
+void operator delete(void *memory, std::align_val_t alignment) noexcept { deallocate(memory, static_cast<std::size_t>(alignment)); }
+void operator delete[](void *memory, std::align_val_t alignment) noexcept { deallocate(memory, static_cast<std::size_t>(alignment)); }
+void operator delete(void *memory, std::size_t, std::align_val_t alignment) noexcept { deallocate(memory, static_cast<std::size_t>(alignment)); }
+void operator delete[](void *memory, std::size_t, std::align_val_t alignment) noexcept { deallocate(memory, static_cast<std::size_t>(alignment)); }
+#endif
+
+uint64_t getPeakResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+#ifdef __APPLE__
+	return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void writeMemoryStats(std::ostream &stream)
+{
+	stream << "Peak RSS: " << getPeakResidentBytes() / 1024 << " KiB\n";
+#ifdef ELF2REL_MEMORY_STATS
+	const char *phaseNames[] = { "other", "ELF load", "symbol maps", "section layout", "relocations", "output" };
+	static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) == static_cast<int>(MemoryPhase::Count), "missing phase name");
+
+	char line[128];
+	snprintf(line, sizeof(line), "%-16s  %12s  %14s\n", "Phase", "Allocations", "Bytes");
+	stream << line;
+	for (int i = 0; i < static_cast<int>(MemoryPhase::Count); ++i)
+	{
+		snprintf(line, sizeof(line), "%-16s  %12llu  %14llu\n",
+				 phaseNames[i],
+				 static_cast<unsigned long long>(phaseCounters[i].allocations.load()),
+				 static_cast<unsigned long long>(phaseCounters[i].bytes.load()));
+		stream << line;
+	}
+#else
+	stream << "Allocation counts need a build with ELF2REL_MEMORY_STATS\n";
+#endif
+}
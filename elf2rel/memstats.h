@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <ostream>
+#include <stdint.h>
+
+// Allocation accounting by conversion phase. Counting replaces the global
+// operator new and is only compiled in when ELF2REL_MEMORY_STATS is defined,
+// otherwise phase scopes compile to nothing and only the peak RSS is known.
+enum class MemoryPhase
+{
+	Other,
+	ElfLoad,
+	SymbolMaps,
+	Layout,
+	Relocations,
+	Output,
+	Count
+};
+
+#ifdef ELF2REL_MEMORY_STATS
+// Attributes allocations on the current thread to a phase until destroyed
+class MemoryPhaseScope
+{
+public:
+	explicit MemoryPhaseScope(MemoryPhase phase);
+	~MemoryPhaseScope();
+	MemoryPhaseScope(const MemoryPhaseScope &) = delete;
+	MemoryPhaseScope &operator=(const MemoryPhaseScope &) = delete;
+
+private:
+	MemoryPhase previous;
+};
+
+// Totals over all phases since the start of the process
+uint64_t getAllocationCount();
+uint64_t getAllocatedBytes();
+#else
+class MemoryPhaseScope
+{
+public:
+	explicit MemoryPhaseScope(MemoryPhase) {}
+};
+#endif
+
+// Peak resident set size of the process in bytes, 0 if unknown
+uint64_t getPeakResidentBytes();
+
+void writeMemoryStats(std::ostream &stream);
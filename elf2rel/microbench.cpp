@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Microbenchmarks for the kernels that dominate different workloads. Inputs
+// come from a fixed seed so runs are comparable. Built with allocation
+// counting, bytes/op is the heap memory allocated per operation.
+
+#include "elf2rel.h"
+#include "convert.h"
+#include "memstats.h"
+#include "symbols.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+static volatile uint64_t benchmarkSink;
+
+// Runs fn(i) for i in [0, iterations) after one warm up call
+template<typename Fn>
+void runBenchmark(const char *name, int iterations, Fn fn)
+{
+	fn(0);
+
+	uint64_t bytesBefore = getAllocatedBytes();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		fn(i);
+	}
+	auto end = std::chrono::steady_clock::now();
+	uint64_t bytes = getAllocatedBytes() - bytesBefore;
+
+	double nanoseconds = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	printf("%-28s  %12.1f ns/op  %10.1f bytes/op\n",
+		   name,
+		   nanoseconds / iterations,
+		   static_cast<double>(bytes) / iterations);
+}
+
+static std::string makeSymbolLine(std::mt19937 &random, int index)
+{
+	char line[96];
+	if (random() % 4 == 0)
+	{
+		snprintf(line, sizeof(line), "%u,%u,%08x:module_symbol_%d",
+				 static_cast<unsigned>(2 + random() % 8),
+				 static_cast<unsigned>(1 + random() % 6),
+				 static_cast<unsigned>(random() % 0x10000),
+				 index);
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "%08x:dol_symbol_%d",
+				 static_cast<unsigned>(0x80003000 + random() % 0x400000),
+				 index);
+	}
+	return line;
+}
+
+static std::vector<Relocation> makeRelocations(std::mt19937 &random, int count, uint32_t moduleID)
+{
+	const uint32_t targetModules[] = { 0, moduleID, 2, 3, 4 };
+	std::vector<Relocation> relocations(count);
+	for (auto &rel : relocations)
+	{
+		rel.moduleID = targetModules[random() % 5];
+		rel.section = 1 + random() % 8;
+		rel.offset = (random() % 0x40000) & ~3u;
+		rel.targetSection = static_cast<uint8_t>(1 + random() % 8);
+		rel.addend = random();
+		rel.type = R_PPC_ADDR32;
+	}
+	return relocations;
+}
+
+// Writes a module of functionCount function sections, each made of bl
+// instructions to random functions
+static void writeBranchModule(std::mt19937 &random, const std::string &filename, int functionCount, int branchCount)
+{
+	ELFIO::elfio writer;
+	writer.create(ELFCLASS32, ELFDATA2MSB);
+	writer.set_type(ET_REL);
+	writer.set_machine(EM_PPC);
+
+	std::vector<uint8_t> branches;
+	for (int i = 0; i < branchCount; ++i)
+	{
+		save<uint32_t>(branches, 0x48000001);
+	}
+	std::vector<uint8_t> prolog;
+	save<uint32_t>(prolog, 0x4E800020);
+
+	auto addTextSection = [&](const std::string &name, const std::vector<uint8_t> &data)
+	{
+		ELFIO::section *section = writer.sections.add(name);
+		section->set_type(SHT_PROGBITS);
+		section->set_flags(SHF_ALLOC | SHF_EXECINSTR);
+		section->set_addr_align(4);
+		section->set_data(reinterpret_cast<const char *>(data.data()), static_cast<ELFIO::Elf_Word>(data.size()));
+		return section;
+	};
+	ELFIO::section *text = addTextSection(".text", prolog);
+	std::vector<ELFIO::section *> functions;
+	for (int i = 0; i < functionCount; ++i)
+	{
+		functions.push_back(addTextSection(".text.function_" + std::to_string(i), branches));
+	}
+
+	ELFIO::section *stringSection = writer.sections.add(".strtab");
+	stringSection->set_type(SHT_STRTAB);
+	ELFIO::section *symbolSection = writer.sections.add(".symtab");
+	symbolSection->set_type(SHT_SYMTAB);
+	symbolSection->set_addr_align(4);
+	symbolSection->set_entry_size(writer.get_default_entry_size(SHT_SYMTAB));
+	symbolSection->set_link(stringSection->get_index());
+	symbolSection->set_info(1);
+	ELFIO::string_section_accessor strings(stringSection);
+	ELFIO::symbol_section_accessor symbols(writer, symbolSection);
+	for (const char *name : { "_prolog", "_epilog", "_unresolved" })
+	{
+		symbols.add_symbol(strings, name, 0, 4, STB_GLOBAL, STT_FUNC, 0, text->get_index());
+	}
+	std::vector<ELFIO::Elf_Word> functionSymbols;
+	for (int i = 0; i < functionCount; ++i)
+	{
+		functionSymbols.push_back(symbols.add_symbol(strings, ("function_" + std::to_string(i)).c_str(), 0,
+													 branches.size(), STB_GLOBAL, STT_FUNC, 0,
+													 functions[i]->get_index()));
+	}
+
+	for (auto *function : functions)
+	{
+		ELFIO::section *relocationSection = writer.sections.add(".rela" + function->get_name());
+		relocationSection->set_type(SHT_RELA);
+		relocationSection->set_addr_align(4);
+		relocationSection->set_entry_size(writer.get_default_entry_size(SHT_RELA));
+		relocationSection->set_link(symbolSection->get_index());
+		relocationSection->set_info(function->get_index());
+		ELFIO::relocation_section_accessor relocations(writer, relocationSection);
+		for (int i = 0; i < branchCount; ++i)
+		{
+			relocations.add_entry(i * 4, functionSymbols[random() % functionCount], R_PPC_REL24, 0);
+		}
+	}
+
+	writer.save(filename);
+}
+
+int main()
+{
+	std::mt19937 random(0x0E1F2E1);
+	const uint32_t moduleID = 0x1000;
+
+	std::vector<std::string> lines;
+	for (int i = 0; i < 4096; ++i)
+	{
+		lines.push_back(makeSymbolLine(random, i));
+	}
+
+	runBenchmark("parseSymbol", 1000000, [&](int i)
+	{
+		SymbolLocation sym;
+		std::string_view name;
+		parseSymbol(lines[i % lines.size()], sym, name);
+		benchmarkSink = benchmarkSink + sym.addr + name.size();
+	});
+
+	std::filesystem::path mapPath = std::filesystem::temp_directory_path() / "elf2rel_microbench.lst";
+	{
+		std::ofstream mapStream(mapPath);
+		for (const auto &line : lines)
+		{
+			mapStream << line << "\n";
+		}
+	}
+	runBenchmark("loadSymbolMap (4096 lines)", 200, [&](int)
+	{
+		Arena arena;
+		SymbolMap symbolMap(arena.getResource());
+		loadSymbolMap(mapPath.string(), arena, symbolMap);
+		benchmarkSink = benchmarkSink + symbolMap.size();
+	});
+	std::filesystem::remove(mapPath);
+
+	std::vector<uint8_t> buffer;
+	buffer.reserve(64);
+	runBenchmark("save<uint32_t>", 10000000, [&](int i)
+	{
+		buffer.clear();
+		save<uint32_t>(buffer, static_cast<uint32_t>(i));
+		benchmarkSink = benchmarkSink + buffer[3];
+	});
+
+	runBenchmark("load<uint32_t>", 10000000, [&](int i)
+	{
+		buffer.assign(4, static_cast<uint8_t>(i));
+		uint32_t value;
+		load(buffer, value);
+		benchmarkSink = benchmarkSink + value;
+	});
+
+	std::vector<uint8_t> relocationBuffer;
+	relocationBuffer.reserve(8 * 4096);
+	runBenchmark("writeRelocation", 10000000, [&](int i)
+	{
+		if (i % 4096 == 0)
+		{
+			relocationBuffer.clear();
+		}
+		writeRelocation(relocationBuffer, i & 0xFFFF, R_PPC_ADDR32, 1, static_cast<uint32_t>(i));
+	});
+	benchmarkSink = benchmarkSink + relocationBuffer.size();
+
+	std::vector<Relocation> relocations = makeRelocations(random, 16384, moduleID);
+	std::vector<Relocation> sortedRelocations;
+	sortedRelocations.reserve(relocations.size());
+	runBenchmark("sort 16384 relocations", 200, [&](int)
+	{
+		sortedRelocations.assign(relocations.begin(), relocations.end());
+		std::sort(sortedRelocations.begin(), sortedRelocations.end(),
+				  [&](const Relocation &left, const Relocation &right)
+		{
+			return isRelocationBefore(left, right, moduleID);
+		});
+		benchmarkSink = benchmarkSink + sortedRelocations.front().offset;
+	});
+
+	// Branches between the function sections of a module loaded with early
+	// resolution off, so every one of them is left for the benchmark
+	std::filesystem::path elfPath = std::filesystem::temp_directory_path() / "elf2rel_microbench.elf";
+	writeBranchModule(random, elfPath.string(), 64, 256);
+	RelModule module;
+	module.options.resolveEarly = false;
+	if (!loadModule(module, elfPath.string()))
+	{
+		printf("Failed to write '%s'\n", elfPath.string().c_str());
+		return 1;
+	}
+	layoutModule(module);
+	collectRelocations(module);
+	std::filesystem::remove(elfPath);
+
+	module.options.resolveEarly = true;
+	std::vector<Relocation> branches(module.internalRelocations.begin(), module.internalRelocations.end());
+	module.patches.reserve(branches.size());
+	runBenchmark("resolveEarly", 10000000, [&](int i)
+	{
+		size_t index = i % branches.size();
+		if (index == 0)
+		{
+			module.patches.clear();
+		}
+		benchmarkSink = benchmarkSink + resolveEarly(module, branches[index]);
+	});
+
+	return 0;
+}
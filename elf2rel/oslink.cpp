@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "oslink.h"
+
+#include "elf2rel.h"
+#include "report.h"
+
+#include <algorithm>
+
+bool parseRelHeader(const std::vector<uint8_t> &data, RelHeader &header)
+{
+	const size_t cBaseHeaderSize = 0x40;
+	if (data.size() < cBaseHeaderSize)
+	{
+		return false;
+	}
+
+	header = {};
+	header.id = loadAt<uint32_t>(data, 0x00);
+	header.sectionCount = loadAt<uint32_t>(data, 0x0C);
+	header.sectionInfoOffset = loadAt<uint32_t>(data, 0x10);
+	header.version = loadAt<uint32_t>(data, 0x1C);
+	header.bssSize = loadAt<uint32_t>(data, 0x20);
+	header.relocationOffset = loadAt<uint32_t>(data, 0x24);
+	header.importInfoOffset = loadAt<uint32_t>(data, 0x28);
+	header.importInfoSize = loadAt<uint32_t>(data, 0x2C);
+	header.prologSection = loadAt<uint8_t>(data, 0x30);
+	header.epilogSection = loadAt<uint8_t>(data, 0x31);
+	header.unresolvedSection = loadAt<uint8_t>(data, 0x32);
+	header.prologOffset = loadAt<uint32_t>(data, 0x34);
+	header.epilogOffset = loadAt<uint32_t>(data, 0x38);
+	header.unresolvedOffset = loadAt<uint32_t>(data, 0x3C);
+	if (header.version >= 2)
+	{
+		if (data.size() < 0x48)
+		{
+			return false;
+		}
+		header.maxAlign = loadAt<uint32_t>(data, 0x40);
+		header.maxBssAlign = loadAt<uint32_t>(data, 0x44);
+	}
+	if (header.version >= 3)
+	{
+		if (data.size() < 0x4C)
+		{
+			return false;
+		}
+		header.fixedDataSize = loadAt<uint32_t>(data, 0x48);
+	}
+
+	return static_cast<uint64_t>(header.sectionInfoOffset) + header.sectionCount * 8ull <= data.size()
+		&& static_cast<uint64_t>(header.importInfoOffset) + header.importInfoSize <= data.size()
+		&& header.importInfoSize % 8 == 0
+		&& header.relocationOffset <= data.size();
+}
+
+bool LinkContext::load(LinkedModule &module,
+					   const std::vector<uint8_t> &data,
+					   uint32_t baseAddress,
+					   uint32_t bssAddress,
+					   std::string &error)
+{
+	if (!parseRelHeader(data, module.header))
+	{
+		error = "invalid REL header";
+		return false;
+	}
+	const RelHeader &header = module.header;
+
+	if (bssAddress == 0)
+	{
+		uint32_t bssAlign = std::max<uint32_t>(header.maxBssAlign, 32);
+		bssAddress = (baseAddress + static_cast<uint32_t>(data.size()) + bssAlign - 1) & ~(bssAlign - 1);
+	}
+	if (header.version >= 2
+		&& ((header.maxAlign && baseAddress % header.maxAlign != 0)
+			|| (header.maxBssAlign && bssAddress % header.maxBssAlign != 0)))
+	{
+		error = "module or bss address does not satisfy the REL's alignment";
+		return false;
+	}
+
+	module.image = data;
+	module.baseAddress = baseAddress;
+	module.bssAddress = bssAddress;
+	module.bss.assign(header.bssSize, 0);
+
+	// Same placement as OSLink, section 0 is never touched and bss sections
+	// are packed one after another without alignment
+	module.sections.clear();
+	uint32_t nextBss = bssAddress;
+	for (uint32_t i = 0; i < header.sectionCount; ++i)
+	{
+		uint32_t offset = loadAt<uint32_t>(data, header.sectionInfoOffset + i * 8);
+		uint32_t size = loadAt<uint32_t>(data, header.sectionInfoOffset + i * 8 + 4);
+
+		LinkedSection section = {};
+		section.size = size;
+		section.exec = (offset & 1) != 0;
+		if (i != 0 && (offset & ~1u) != 0)
+		{
+			if ((offset & ~1u) + static_cast<uint64_t>(size) > data.size())
+			{
+				error = "section " + std::to_string(i) + " lies outside the file";
+				return false;
+			}
+			section.address = baseAddress + (offset & ~1u);
+		}
+		else if (i != 0 && size != 0)
+		{
+			section.address = nextBss;
+			section.bss = true;
+			nextBss += size;
+		}
+		module.sections.push_back(section);
+	}
+	if (nextBss - bssAddress > header.bssSize)
+	{
+		error = "bss sections are larger than the header's bss size";
+		return false;
+	}
+
+	return true;
+}
+
+uint8_t *LinkContext::translate(uint32_t address, uint32_t size)
+{
+	for (LinkedModule *module : modules)
+	{
+		if (address >= module->baseAddress
+			&& static_cast<uint64_t>(address) + size <= static_cast<uint64_t>(module->baseAddress) + module->image.size())
+		{
+			return module->image.data() + (address - module->baseAddress);
+		}
+		if (address >= module->bssAddress
+			&& static_cast<uint64_t>(address) + size <= static_cast<uint64_t>(module->bssAddress) + module->bss.size())
+		{
+			return module->bss.data() + (address - module->bssAddress);
+		}
+	}
+	return nullptr;
+}
+
+static uint32_t readWord(const uint8_t *p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void writeWord(uint8_t *p, uint32_t value)
+{
+	p[0] = static_cast<uint8_t>(value >> 24);
+	p[1] = static_cast<uint8_t>(value >> 16);
+	p[2] = static_cast<uint8_t>(value >> 8);
+	p[3] = static_cast<uint8_t>(value);
+}
+
+uint32_t attachRelocationFile(std::vector<uint8_t> &data, const std::vector<uint8_t> &relocations)
+{
+	if (data.size() < 0x30)
+	{
+		return 0;
+	}
+	uint32_t delta = static_cast<uint32_t>((data.size() + 7) & ~size_t(7));
+	data.resize(delta);
+	data.insert(data.end(), relocations.begin(), relocations.end());
+
+	uint32_t importInfoOffset = readWord(&data[0x28]) + delta;
+	uint32_t importInfoSize = readWord(&data[0x2C]);
+	writeWord(&data[0x24], readWord(&data[0x24]) + delta);
+	writeWord(&data[0x28], importInfoOffset);
+	for (uint32_t offset = importInfoOffset; offset + 8 <= importInfoOffset + importInfoSize && offset + 8 <= data.size(); offset += 8)
+	{
+		writeWord(&data[offset + 4], readWord(&data[offset + 4]) + delta);
+	}
+	return delta;
+}
+
+static void writeHalf(uint8_t *p, uint32_t value)
+{
+	p[0] = static_cast<uint8_t>(value >> 8);
+	p[1] = static_cast<uint8_t>(value);
+}
+
+// Applies the importer's relocations against target, or against the dol if
+// target is null. Mirrors Relocate() in the Dolphin OS.
+bool LinkContext::relocate(LinkedModule &importer, const LinkedModule *target, uint32_t relocationOffset, LinkStats &stats, std::string &error)
+{
+	const std::vector<uint8_t> &data = importer.image;
+	uint32_t p = 0;
+	for (size_t offset = relocationOffset; ; offset += 8)
+	{
+		if (offset + 8 > data.size())
+		{
+			error = "relocation table runs past the end of the file";
+			return false;
+		}
+
+		uint16_t relOffset = loadAt<uint16_t>(data, offset);
+		uint8_t type = loadAt<uint8_t>(data, offset + 2);
+		uint8_t section = loadAt<uint8_t>(data, offset + 3);
+		uint32_t addend = loadAt<uint32_t>(data, offset + 4);
+
+		p += relOffset;
+		stats.estimatedCycles += getRecordCost(type);
+		if (type == R_DOLPHIN_END)
+		{
+			return true;
+		}
+		else if (type == R_DOLPHIN_NOP)
+		{
+			continue;
+		}
+		else if (type == R_DOLPHIN_SECTION)
+		{
+			if (section >= importer.sections.size())
+			{
+				error = "R_DOLPHIN_SECTION references section " + std::to_string(section);
+				return false;
+			}
+			p = importer.sections[section].address;
+			stats.sectionSwitches++;
+			continue;
+		}
+
+		uint32_t x = addend;
+		if (target)
+		{
+			if (section >= target->sections.size())
+			{
+				error = "relocation references section " + std::to_string(section) + " of module " + std::to_string(target->header.id);
+				return false;
+			}
+			x += target->sections[section].address;
+		}
+
+		uint32_t size = type == R_PPC_ADDR16 || type == R_PPC_ADDR16_LO || type == R_PPC_ADDR16_HI || type == R_PPC_ADDR16_HA ? 2 : 4;
+		uint8_t *patch = translate(p, size);
+		if (!patch)
+		{
+			char message[64];
+			snprintf(message, sizeof(message), "relocation writes outside any module at %08x", p);
+			error = message;
+			return false;
+		}
+
+		switch (type)
+		{
+		case R_PPC_ADDR32:
+			writeWord(patch, x);
+			break;
+		case R_PPC_ADDR24:
+			writeWord(patch, (readWord(patch) & ~0x03FFFFFCu) | (x & 0x03FFFFFC));
+			break;
+		case R_PPC_ADDR16:
+		case R_PPC_ADDR16_LO:
+			writeHalf(patch, x);
+			break;
+		case R_PPC_ADDR16_HI:
+			writeHalf(patch, x >> 16);
+			break;
+		case R_PPC_ADDR16_HA:
+			writeHalf(patch, (x >> 16) + ((x & 0x8000) ? 1 : 0));
+			break;
+		case R_PPC_ADDR14:
+		case R_PPC_ADDR14_BRTAKEN:
+		case R_PPC_ADDR14_BRNKTAKEN:
+			writeWord(patch, (readWord(patch) & ~0x0000FFFCu) | (x & 0x0000FFFC));
+			break;
+		case R_PPC_REL24:
+			writeWord(patch, (readWord(patch) & ~0x03FFFFFCu) | ((x - p) & 0x03FFFFFC));
+			break;
+		case R_PPC_REL14:
+			writeWord(patch, (readWord(patch) & ~0x0000FFFCu) | ((x - p) & 0x0000FFFC));
+			break;
+		default:
+			// OSLink gives up on the whole module here
+			stats.unknownRelocations++;
+			error = "unsupported relocation type " + std::to_string(type);
+			return false;
+		}
+
+		stats.relocationsApplied++;
+		stats.bytesTouched += size;
+		stats.types[type]++;
+	}
+}
+
+bool LinkContext::link(LinkedModule &module, bool fixed, LinkStats &stats, std::string &error)
+{
+	if (fixed && module.header.version < 3)
+	{
+		error = "OSLinkFixed requires a version 3 REL";
+		return false;
+	}
+	if (std::find(modules.begin(), modules.end(), &module) != modules.end())
+	{
+		error = "module is already linked";
+		return false;
+	}
+	for (const LinkedModule *other : modules)
+	{
+		if (other->header.id == module.header.id)
+		{
+			error = "a module with ID " + std::to_string(module.header.id) + " is already linked";
+			return false;
+		}
+	}
+	modules.push_back(&module);
+
+	// Walks the importer's imports for the target's ID
+	auto relocateImports = [&](LinkedModule &importer, const LinkedModule *target)
+	{
+		uint32_t targetID = target ? target->header.id : 0;
+		for (uint32_t i = 0; i < importer.header.importInfoSize / 8; ++i)
+		{
+			size_t importOffset = importer.header.importInfoOffset + i * 8;
+			if (loadAt<uint32_t>(importer.image, importOffset) == targetID)
+			{
+				return relocate(importer, target, loadAt<uint32_t>(importer.image, importOffset + 4), stats, error);
+			}
+		}
+		return true;
+	};
+
+	for (LinkedModule *other : modules)
+	{
+		if (!relocateImports(*other, &module)
+			|| (other != &module && !relocateImports(module, other)))
+		{
+			return false;
+		}
+	}
+	if (!relocateImports(module, nullptr))
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < module.header.importInfoSize / 8; ++i)
+	{
+		uint32_t id = loadAt<uint32_t>(module.image, module.header.importInfoOffset + i * 8);
+		if (id != 0 && std::none_of(modules.begin(), modules.end(), [&](const LinkedModule *other) { return other->header.id == id; }))
+		{
+			stats.importsSkipped++;
+		}
+	}
+
+	if (fixed)
+	{
+		// OSLinkFixed drops the imports from the first dol or self import on
+		// and the caller frees everything after fixedDataSize
+		for (uint32_t i = 0; i < module.header.importInfoSize / 8; ++i)
+		{
+			uint32_t id = loadAt<uint32_t>(module.image, module.header.importInfoOffset + i * 8);
+			if (id == 0 || id == module.header.id)
+			{
+				module.header.importInfoSize = i * 8;
+				break;
+			}
+		}
+		if (module.header.fixedDataSize < module.image.size())
+		{
+			stats.bytesTrimmed = static_cast<uint32_t>(module.image.size()) - module.header.fixedDataSize;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Host side emulation of OSLink/OSLinkFixed, used to verify generated RELs and
+// to measure what linking them costs without running the game.
+
+struct RelHeader
+{
+	uint32_t id;
+	uint32_t sectionCount;
+	uint32_t sectionInfoOffset;
+	uint32_t version;
+	uint32_t bssSize;
+	uint32_t relocationOffset;
+	uint32_t importInfoOffset;
+	uint32_t importInfoSize;
+	uint8_t prologSection;
+	uint8_t epilogSection;
+	uint8_t unresolvedSection;
+	uint32_t prologOffset;
+	uint32_t epilogOffset;
+	uint32_t unresolvedOffset;
+	uint32_t maxAlign;
+	uint32_t maxBssAlign;
+	uint32_t fixedDataSize;
+};
+
+struct LinkedSection
+{
+	uint32_t address; // 0 for removed sections
+	uint32_t size;
+	bool exec;
+	bool bss;
+};
+
+struct LinkStats
+{
+	int relocationsApplied = 0;
+	int bytesTouched = 0;
+	int sectionSwitches = 0;
+	int unknownRelocations = 0;
+	int importsSkipped = 0; // imports of modules that are not loaded
+	uint32_t bytesTrimmed = 0; // freed after OSLinkFixed
+	uint64_t estimatedCycles = 0;
+	std::map<int, int> types;
+};
+
+// A REL placed in emulated memory
+struct LinkedModule
+{
+	RelHeader header;
+	uint32_t baseAddress = 0;
+	uint32_t bssAddress = 0;
+	std::vector<uint8_t> image; // the REL file, relocated in place
+	std::vector<uint8_t> bss;
+	std::vector<LinkedSection> sections;
+};
+
+bool parseRelHeader(const std::vector<uint8_t> &data, RelHeader &header);
+
+// Places the tables of a REL written with elf2rel --relocations-out after
+// the REL, 8 byte aligned, and moves the header's import and relocation
+// offsets and the imports' offsets by their distance from the module, like a
+// loader reading them into a scratch buffer does. Returns where the tables
+// start, 0 if data is not a REL.
+uint32_t attachRelocationFile(std::vector<uint8_t> &data, const std::vector<uint8_t> &relocations);
+
+// Emulated address space holding every linked module. The dol itself is not
+// needed, relocations against it only use the addresses from the REL.
+class LinkContext
+{
+public:
+	// Places a REL at baseAddress with its bss at bssAddress (0 to place it
+	// right after the image). Fails if the REL is malformed or misaligned.
+	bool load(LinkedModule &module,
+			  const std::vector<uint8_t> &data,
+			  uint32_t baseAddress,
+			  uint32_t bssAddress,
+			  std::string &error);
+
+	// Links a loaded module against the dol and all modules linked before,
+	// and links those modules against it, like OSLink. Fixed linking trims
+	// the dol and self imports after they were applied, like OSLinkFixed.
+	bool link(LinkedModule &module, bool fixed, LinkStats &stats, std::string &error);
+
+private:
+	bool relocate(LinkedModule &importer, const LinkedModule *target, uint32_t relocationOffset, LinkStats &stats, std::string &error);
+	uint8_t *translate(uint32_t address, uint32_t size);
+
+	std::vector<LinkedModule *> modules;
+};
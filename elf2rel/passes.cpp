@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "passes.h"
+
+#include "elf2rel.h"
+
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <set>
+
+const std::vector<std::string> cRelSectionMask = {
+	".init",
+	".text",
+	".ctors",
+	".dtors",
+	".rodata",
+	".data",
+	".bss"
+};
+
+void SectionMatcher::addPattern(const std::string &pattern)
+{
+	if (!pattern.empty() && pattern.back() == '*')
+	{
+		prefixes.push_back(pattern.substr(0, pattern.size() - 1));
+		return;
+	}
+	names.insert(std::upper_bound(names.begin(), names.end(), pattern), pattern);
+	prefixes.push_back(pattern + ".");
+}
+
+bool SectionMatcher::matches(const std::string &name) const
+{
+	if (std::binary_search(names.begin(), names.end(), name))
+	{
+		return true;
+	}
+	return std::any_of(prefixes.begin(), prefixes.end(), [&](const std::string &prefix)
+	{
+		return name.compare(0, prefix.size(), prefix) == 0;
+	});
+}
+
+SectionMatcher createSectionMatcher(const std::vector<std::string> &extraPatterns)
+{
+	SectionMatcher matcher;
+	for (const auto &pattern : cRelSectionMask)
+	{
+		matcher.addPattern(pattern);
+	}
+	for (const auto &pattern : extraPatterns)
+	{
+		matcher.addPattern(pattern);
+	}
+	return matcher;
+}
+
+std::vector<bool> findKeptSections(ELFIO::elfio &inputElf, const SectionMatcher &matcher)
+{
+	std::vector<bool> keptSections(inputElf.sections.size());
+	for (const auto &section : inputElf.sections)
+	{
+		keptSections[section->get_index()] = matcher.matches(section->get_name());
+	}
+	return keptSections;
+}
+
+void redirectMergedTarget(const std::map<int, MergedSection> &mergedSections, int &sectionIndex, uint32_t &offset)
+{
+	auto it = mergedSections.find(sectionIndex);
+	if (it == mergedSections.end() || it->second.pieces.empty())
+	{
+		return;
+	}
+
+	// Find the last piece starting at or before the offset
+	const std::vector<MergedPiece> &pieces = it->second.pieces;
+	auto pieceIt = std::upper_bound(pieces.begin(), pieces.end(), offset,
+									[](uint32_t value, const MergedPiece &piece)
+	{
+		return value < piece.inputOffset;
+	});
+	if (pieceIt != pieces.begin())
+	{
+		--pieceIt;
+	}
+	sectionIndex = it->second.outputSection;
+	offset = pieceIt->outputOffset + (offset - pieceIt->inputOffset);
+}
+
+std::vector<bool> findZeroDataSections(ELFIO::elfio &inputElf,
+									   const std::vector<bool> &keptSections,
+									   const std::vector<ELFIO::section *> &relocationSections)
+{
+	std::set<int> relocatedSections;
+	for (const auto &section : relocationSections)
+	{
+		if (section->get_size() > 0)
+		{
+			relocatedSections.insert(section->get_info());
+		}
+	}
+
+	SectionMatcher dataMatcher;
+	dataMatcher.addPattern(".data");
+	std::vector<bool> zeroSections(inputElf.sections.size());
+	for (const auto &section : inputElf.sections)
+	{
+		int sectionIndex = section->get_index();
+		if (section->get_type() != SHT_PROGBITS
+			|| (section->get_flags() & SHF_EXECINSTR)
+			|| section->get_size() == 0
+			|| !keptSections[sectionIndex]
+			|| relocatedSections.count(sectionIndex)
+			|| !dataMatcher.matches(section->get_name()))
+		{
+			continue;
+		}
+		const char *data = section->get_data();
+		zeroSections[sectionIndex] = data && std::all_of(data, data + section->get_size(), [](char c)
+		{
+			return c == 0;
+		});
+	}
+	return zeroSections;
+}
+
+std::map<int, MergedSection> mergeConstantSections(ELFIO::elfio &inputElf,
+												   const std::vector<bool> &keptSections,
+												   const std::vector<ELFIO::section *> &relocationSections)
+{
+	// Sections carrying relocations of their own are left alone
+	std::set<int> relocatedSections;
+	for (const auto &section : relocationSections)
+	{
+		relocatedSections.insert(section->get_info());
+	}
+
+	std::map<std::pair<bool, ELFIO::Elf_Xword>, std::vector<ELFIO::section *>> groups;
+	for (const auto &section : inputElf.sections)
+	{
+		ELFIO::Elf_Xword entrySize = section->get_entry_size();
+		if (section->get_type() == SHT_PROGBITS
+			&& (section->get_flags() & SHF_MERGE)
+			&& entrySize != 0
+			&& section->get_size() % entrySize == 0
+			&& keptSections[section->get_index()]
+			&& !relocatedSections.count(section->get_index()))
+		{
+			bool strings = (section->get_flags() & SHF_STRINGS) != 0;
+			groups[std::make_pair(strings, entrySize)].push_back(section);
+		}
+	}
+
+	std::map<int, MergedSection> mergedSections;
+	for (const auto &group : groups)
+	{
+		bool strings = group.first.first;
+		uint32_t entrySize = static_cast<uint32_t>(group.first.second);
+		const std::vector<ELFIO::section *> &sections = group.second;
+
+		uint32_t align = 1;
+		for (const auto &section : sections)
+		{
+			align = std::max(align, static_cast<uint32_t>(section->get_addr_align()));
+		}
+
+		// Split into pieces, strings end after a zero entry
+		struct InputPiece
+		{
+			ELFIO::section *section;
+			uint32_t offset;
+			std::string data;
+		};
+		std::vector<InputPiece> inputPieces;
+		for (const auto &section : sections)
+		{
+			uint32_t size = static_cast<uint32_t>(section->get_size());
+			uint32_t pieceStart = 0;
+			for (uint32_t offset = 0; offset < size; offset += entrySize)
+			{
+				bool isEnd = true;
+				if (strings)
+				{
+					isEnd = std::all_of(section->get_data() + offset,
+										section->get_data() + offset + entrySize,
+										[](char c) { return c == 0; })
+						|| offset + entrySize == size;
+				}
+				if (isEnd)
+				{
+					inputPieces.push_back({ section,
+											pieceStart,
+											std::string(section->get_data() + pieceStart,
+														offset + entrySize - pieceStart) });
+					pieceStart = offset + entrySize;
+				}
+			}
+		}
+
+		// Unique pieces in the order they will be laid out. Strings are sorted
+		// by their reversed contents so a string directly follows the strings
+		// it is a suffix of.
+		std::vector<std::string> uniquePieces;
+		for (const auto &piece : inputPieces)
+		{
+			uniquePieces.push_back(piece.data);
+		}
+		if (strings)
+		{
+			std::sort(uniquePieces.begin(), uniquePieces.end(),
+					  [](const std::string &left, const std::string &right)
+			{
+				return std::lexicographical_compare(right.rbegin(), right.rend(),
+													left.rbegin(), left.rend());
+			});
+			uniquePieces.erase(std::unique(uniquePieces.begin(), uniquePieces.end()), uniquePieces.end());
+		}
+		else
+		{
+			std::set<std::string> seen;
+			uniquePieces.erase(std::remove_if(uniquePieces.begin(), uniquePieces.end(),
+											  [&](const std::string &piece)
+			{
+				return !seen.insert(piece).second;
+			}), uniquePieces.end());
+		}
+
+		std::vector<uint8_t> outputData;
+		std::map<std::string, uint32_t> outputOffsets;
+		const std::string *previous = nullptr;
+		uint32_t previousOffset = 0;
+		for (const auto &piece : uniquePieces)
+		{
+			// Tail merge if the position inside the previous string is aligned
+			if (strings && previous && boost::ends_with(*previous, piece))
+			{
+				uint32_t tailOffset = previousOffset + static_cast<uint32_t>(previous->size() - piece.size());
+				if (tailOffset % align == 0 && tailOffset % entrySize == 0)
+				{
+					outputOffsets[piece] = tailOffset;
+					continue;
+				}
+			}
+
+			while (outputData.size() % align != 0)
+			{
+				save<uint8_t>(outputData, 0);
+			}
+			uint32_t offset = static_cast<uint32_t>(outputData.size());
+			outputData.insert(outputData.end(), piece.begin(), piece.end());
+			outputOffsets[piece] = offset;
+			previous = &piece;
+			previousOffset = offset;
+		}
+
+		int outputSection = sections.front()->get_index();
+		for (const auto &piece : inputPieces)
+		{
+			MergedSection &merged = mergedSections[piece.section->get_index()];
+			merged.outputSection = outputSection;
+			merged.pieces.push_back({ piece.offset,
+									  outputOffsets.at(piece.data),
+									  static_cast<uint32_t>(piece.data.size()) });
+		}
+
+		sections.front()->set_data(reinterpret_cast<const char *>(outputData.data()),
+								   static_cast<ELFIO::Elf_Word>(outputData.size()));
+		sections.front()->set_addr_align(align);
+	}
+
+	return mergedSections;
+}
+
+// Relocation as seen by identical code folding. Targets are normalized so that
+// relocations against the same symbol compare equal regardless of symbol index.
+struct FoldRelocation
+{
+	uint32_t offset;
+	uint32_t type;
+	int targetSection; // 0 for external symbols
+	std::string externalName;
+	uint32_t addend; // symbol value + addend for internal targets
+};
+
+std::map<int, int> foldIdenticalSections(ELFIO::elfio &inputElf,
+										 const std::vector<bool> &keptSections,
+										 ELFIO::symbol_section_accessor &symbols,
+										 const std::vector<ELFIO::section *> &relocationSections,
+										 const std::map<int, MergedSection> &mergedSections)
+{
+	struct FoldCandidate
+	{
+		ELFIO::section *section;
+		std::vector<FoldRelocation> relocations;
+		uint64_t contentHash;
+		bool foldable;
+	};
+
+	std::vector<FoldCandidate> candidates;
+	std::map<int, size_t> candidateIndices;
+	for (const auto &section : inputElf.sections)
+	{
+		if (section->get_type() == SHT_PROGBITS
+			&& (section->get_flags() & SHF_EXECINSTR)
+			&& section->get_name().find(".text.") == 0
+			&& keptSections[section->get_index()])
+		{
+			// FNV-1a over the section bytes
+			uint64_t hash = 14695981039346656037ull;
+			for (ELFIO::Elf_Xword i = 0; i < section->get_size(); ++i)
+			{
+				hash = (hash ^ static_cast<uint8_t>(section->get_data()[i])) * 1099511628211ull;
+			}
+			candidateIndices[section->get_index()] = candidates.size();
+			candidates.push_back({ section, {}, hash, true });
+		}
+	}
+
+	for (const auto &section : relocationSections)
+	{
+		auto candidateIt = candidateIndices.find(section->get_info());
+		if (candidateIt == candidateIndices.end())
+		{
+			continue;
+		}
+
+		FoldCandidate &candidate = candidates[candidateIt->second];
+		ELFIO::relocation_section_accessor relocations(inputElf, section);
+		for (ELFIO::Elf_Xword i = 0; i < relocations.get_entries_num(); ++i)
+		{
+			ELFIO::Elf64_Addr offset = 0;
+			ELFIO::Elf_Word symbol = 0;
+			ELFIO::Elf_Word type = 0;
+			ELFIO::Elf_Sxword addend = 0;
+			relocations.get_entry(i, offset, symbol, type, addend);
+
+			std::string symbolName;
+			ELFIO::Elf64_Addr symbolValue;
+			ELFIO::Elf_Xword size;
+			unsigned char bind;
+			unsigned char symbolType;
+			ELFIO::Elf_Half sectionIndex;
+			unsigned char other;
+			FoldRelocation rel;
+			rel.offset = static_cast<uint32_t>(offset);
+			rel.type = type;
+			if (!symbols.get_symbol(symbol, symbolName, symbolValue,
+									size, bind, symbolType, sectionIndex, other))
+			{
+				// Leave anything we cannot describe alone
+				candidate.foldable = false;
+				continue;
+			}
+			else if (sectionIndex)
+			{
+				rel.targetSection = sectionIndex;
+				rel.addend = static_cast<uint32_t>(addend + symbolValue);
+				redirectMergedTarget(mergedSections, rel.targetSection, rel.addend);
+			}
+			else
+			{
+				rel.targetSection = 0;
+				rel.externalName = symbolName;
+				rel.addend = static_cast<uint32_t>(addend);
+			}
+			candidate.relocations.emplace_back(rel);
+		}
+	}
+
+	for (auto &candidate : candidates)
+	{
+		std::sort(candidate.relocations.begin(), candidate.relocations.end(),
+				  [](const FoldRelocation &left, const FoldRelocation &right)
+		{
+			return left.offset < right.offset;
+		});
+	}
+
+	std::map<int, int> foldedSections;
+	auto getReplacement = [&](int sectionIndex)
+	{
+		auto it = foldedSections.find(sectionIndex);
+		return it != foldedSections.end() ? it->second : sectionIndex;
+	};
+
+	// Two candidates are identical if their bytes match and every relocation
+	// targets the same place once earlier folds are taken into account
+	auto isIdentical = [&](const FoldCandidate &left, const FoldCandidate &right)
+	{
+		if (left.contentHash != right.contentHash
+			|| left.section->get_size() != right.section->get_size()
+			|| left.section->get_addr_align() != right.section->get_addr_align()
+			|| left.relocations.size() != right.relocations.size()
+			|| !std::equal(left.section->get_data(),
+						   left.section->get_data() + left.section->get_size(),
+						   right.section->get_data()))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < left.relocations.size(); ++i)
+		{
+			const FoldRelocation &l = left.relocations[i];
+			const FoldRelocation &r = right.relocations[i];
+			if (l.offset != r.offset
+				|| l.type != r.type
+				|| l.addend != r.addend
+				|| l.externalName != r.externalName)
+			{
+				return false;
+			}
+
+			// Self references are equal to each other
+			bool leftSelf = l.targetSection == static_cast<int>(left.section->get_index());
+			bool rightSelf = r.targetSection == static_cast<int>(right.section->get_index());
+			if (leftSelf != rightSelf
+				|| (!leftSelf && getReplacement(l.targetSection) != getReplacement(r.targetSection)))
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	// Folding a section can make sections that reference it identical, repeat
+	// until nothing changes
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		std::map<uint64_t, std::vector<size_t>> survivorsByHash;
+		for (size_t i = 0; i < candidates.size(); ++i)
+		{
+			const FoldCandidate &candidate = candidates[i];
+			if (!candidate.foldable
+				|| foldedSections.count(candidate.section->get_index()))
+			{
+				continue;
+			}
+
+			std::vector<size_t> &survivors = survivorsByHash[candidate.contentHash];
+			auto survivorIt = std::find_if(survivors.begin(), survivors.end(), [&](size_t survivor)
+			{
+				return isIdentical(candidates[survivor], candidate);
+			});
+			if (survivorIt != survivors.end())
+			{
+				// This section may have survived an earlier pass, sections
+				// folded into it move to the new survivor so that every
+				// replacement is a section that is kept
+				int sectionIndex = candidate.section->get_index();
+				int replacement = candidates[*survivorIt].section->get_index();
+				for (auto &folded : foldedSections)
+				{
+					if (folded.second == sectionIndex)
+					{
+						folded.second = replacement;
+					}
+				}
+				foldedSections[sectionIndex] = replacement;
+				changed = true;
+			}
+			else
+			{
+				survivors.push_back(i);
+			}
+		}
+	}
+
+	return foldedSections;
+}
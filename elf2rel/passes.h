@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "elfio/elfio.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Input section name patterns, matched without allocating. A pattern matches
+// the section of that name and its subsections (".text" matches ".text" and
+// ".text.main"), a pattern ending in * matches every name with that prefix.
+struct SectionMatcher
+{
+	std::vector<std::string> names; // sorted
+	std::vector<std::string> prefixes;
+
+	void addPattern(const std::string &pattern);
+	bool matches(const std::string &name) const;
+};
+
+// Matcher for the sections OSLink expects in a REL plus any extra patterns
+SectionMatcher createSectionMatcher(const std::vector<std::string> &extraPatterns);
+
+// Whether each input section is part of the REL image, indexed by section index
+std::vector<bool> findKeptSections(ELFIO::elfio &inputElf, const SectionMatcher &matcher);
+
+// Piece of an SHF_MERGE input section and where it was placed in the merged output
+struct MergedPiece
+{
+	uint32_t inputOffset;
+	uint32_t outputOffset;
+	uint32_t size;
+};
+
+struct MergedSection
+{
+	int outputSection;
+	std::vector<MergedPiece> pieces;
+};
+
+// Moves a section relative target into the merged section that replaced it
+void redirectMergedTarget(const std::map<int, MergedSection> &mergedSections, int &sectionIndex, uint32_t &offset);
+
+// Finds kept .data sections that are all zero and carry no relocations of
+// their own, they can be placed in bss without changing the linked image.
+// Indexed by section index.
+std::vector<bool> findZeroDataSections(ELFIO::elfio &inputElf,
+									   const std::vector<bool> &keptSections,
+									   const std::vector<ELFIO::section *> &relocationSections);
+
+// Deduplicates the entries of SHF_MERGE sections (strings and fixed size
+// constants). All sections with the same entry kind are merged into the first
+// one, strings are additionally tail merged. Returns where every piece of every
+// merged input section ended up.
+std::map<int, MergedSection> mergeConstantSections(ELFIO::elfio &inputElf,
+												   const std::vector<bool> &keptSections,
+												   const std::vector<ELFIO::section *> &relocationSections);
+
+// Folds byte-identical .text.* sections with equivalent relocations into a
+// single copy. Returns a map from each folded section index to the index of the
+// section that replaces it.
+std::map<int, int> foldIdenticalSections(ELFIO::elfio &inputElf,
+										 const std::vector<bool> &keptSections,
+										 ELFIO::symbol_section_accessor &symbols,
+										 const std::vector<ELFIO::section *> &relocationSections,
+										 const std::map<int, MergedSection> &mergedSections);
@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "report.h"
+
+#include "elf2rel.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+// Rough cycle costs of OSLink's relocation loop on Gekko. Every entry is
+// fetched and dispatched, patching entries additionally read-modify-write the
+// target, section switches look up the section table and every import walks
+// the loaded module list.
+const int cRecordCost = 12;
+const int cWriteCost = 4;
+const int cReadModifyWriteCost = 8;
+const int cSectionSwitchCost = 8;
+const int cImportCost = 40;
+
+int getRecordCost(int type)
+{
+	switch (type)
+	{
+	case R_PPC_ADDR32:
+	case R_PPC_ADDR16:
+	case R_PPC_ADDR16_LO:
+	case R_PPC_ADDR16_HI:
+	case R_PPC_ADDR16_HA:
+		return cRecordCost + cWriteCost;
+	case R_PPC_ADDR24:
+	case R_PPC_ADDR14:
+	case R_PPC_ADDR14_BRTAKEN:
+	case R_PPC_ADDR14_BRNKTAKEN:
+	case R_PPC_REL24:
+	case R_PPC_REL14:
+		return cRecordCost + cReadModifyWriteCost;
+	case R_DOLPHIN_SECTION:
+		return cRecordCost + cSectionSwitchCost;
+	default:
+		return cRecordCost;
+	}
+}
+
+void RelocationReport::addRecord(uint32_t moduleID, int section, int type)
+{
+	const int recordSize = 8;
+
+	if (modules.find(moduleID) == modules.end())
+	{
+		estimatedCycles += cImportCost;
+	}
+	RelocationStats &module = modules[moduleID];
+	module.bytes += recordSize;
+
+	RelocationStats &typeStats = types[type];
+	typeStats.count++;
+	typeStats.bytes += recordSize;
+
+	if (type != R_DOLPHIN_NOP && type != R_DOLPHIN_SECTION && type != R_DOLPHIN_END)
+	{
+		module.count++;
+		RelocationStats &sectionStats = sections[section];
+		sectionStats.count++;
+		sectionStats.bytes += recordSize;
+	}
+	else if (type == R_DOLPHIN_SECTION)
+	{
+		sections[section].bytes += recordSize;
+	}
+
+	estimatedCycles += getRecordCost(type);
+}
+
+const char *getRelocationTypeName(int type)
+{
+	switch (type)
+	{
+	case R_PPC_NONE: return "R_PPC_NONE";
+	case R_PPC_ADDR32: return "R_PPC_ADDR32";
+	case R_PPC_ADDR24: return "R_PPC_ADDR24";
+	case R_PPC_ADDR16: return "R_PPC_ADDR16";
+	case R_PPC_ADDR16_LO: return "R_PPC_ADDR16_LO";
+	case R_PPC_ADDR16_HI: return "R_PPC_ADDR16_HI";
+	case R_PPC_ADDR16_HA: return "R_PPC_ADDR16_HA";
+	case R_PPC_ADDR14: return "R_PPC_ADDR14";
+	case R_PPC_ADDR14_BRTAKEN: return "R_PPC_ADDR14_BRTAKEN";
+	case R_PPC_ADDR14_BRNKTAKEN: return "R_PPC_ADDR14_BRNKTAKEN";
+	case R_PPC_REL24: return "R_PPC_REL24";
+	case R_PPC_REL14: return "R_PPC_REL14";
+	case R_PPC_REL32: return "R_PPC_REL32";
+	case R_DOLPHIN_NOP: return "R_DOLPHIN_NOP";
+	case R_DOLPHIN_SECTION: return "R_DOLPHIN_SECTION";
+	case R_DOLPHIN_END: return "R_DOLPHIN_END";
+	default: return "unknown";
+	}
+}
+
+static std::vector<std::pair<std::string, int>> getTopSymbols(const RelocationReport &report, int count)
+{
+	std::vector<std::pair<std::string, int>> symbols(report.symbolFanIn.begin(), report.symbolFanIn.end());
+	std::stable_sort(symbols.begin(), symbols.end(),
+					 [](const std::pair<std::string, int> &left, const std::pair<std::string, int> &right)
+	{
+		return left.second > right.second;
+	});
+	if (symbols.size() > static_cast<size_t>(count))
+	{
+		symbols.resize(count);
+	}
+	return symbols;
+}
+
+static std::string getSectionName(const RelocationReport &report, uint32_t section)
+{
+	auto it = report.sectionNames.find(section);
+	return it != report.sectionNames.end() ? it->second : "";
+}
+
+static int getEmittedCount(const RelocationReport &report)
+{
+	int count = 0;
+	for (const auto &module : report.modules)
+	{
+		count += module.second.count;
+	}
+	return count;
+}
+
+void writeReportText(std::ostream &stream, const RelocationReport &report, int topSymbolCount)
+{
+	stream << "Relocations: " << getEmittedCount(report) << " emitted ("
+		   << report.deferred << " against dol/self), "
+		   << report.earlyResolved << " resolved early, "
+		   << report.relaxed << " pairs relaxed, "
+		   << report.lazyCalls << " calls bound lazily, "
+		   << report.unresolved << " unresolved\n";
+	stream << "Import table: " << report.importBytes << " bytes\n";
+	stream << "Relocation table: " << report.relocationBytes << " bytes ("
+		   << report.fixedRelocationBytes << " kept by OSLinkFixed)\n";
+	if (report.zeroDataBytes > 0)
+	{
+		stream << "Zero data: " << report.zeroDataBytes << " bytes moved to bss\n";
+	}
+	if (report.initBytes > 0)
+	{
+		stream << "Init sections: " << report.initBytes << " bytes reclaimable after _prolog\n";
+	}
+	if (report.cachedSections > 0)
+	{
+		stream << "Relocation cache: " << report.reusedSections << " of " << report.cachedSections << " sections reused\n";
+	}
+	stream << "Estimated OSLink cost: " << report.estimatedCycles << " cycles\n";
+
+	stream << "\nBy import module:\n";
+	stream << std::setw(12) << "module" << std::setw(10) << "count" << std::setw(10) << "bytes" << "\n";
+	for (const auto &module : report.modules)
+	{
+		stream << std::setw(12) << module.first
+			   << std::setw(10) << module.second.count
+			   << std::setw(10) << module.second.bytes << "\n";
+	}
+
+	stream << "\nBy source section:\n";
+	stream << std::setw(8) << "index" << std::setw(10) << "count" << std::setw(10) << "bytes" << "  name\n";
+	for (const auto &section : report.sections)
+	{
+		stream << std::setw(8) << section.first
+			   << std::setw(10) << section.second.count
+			   << std::setw(10) << section.second.bytes
+			   << "  " << getSectionName(report, section.first) << "\n";
+	}
+
+	stream << "\nBy relocation type:\n";
+	stream << std::setw(24) << "type" << std::setw(10) << "count" << std::setw(10) << "bytes" << "\n";
+	for (const auto &type : report.types)
+	{
+		stream << std::setw(24) << getRelocationTypeName(type.first)
+			   << std::setw(10) << type.second.count
+			   << std::setw(10) << type.second.bytes << "\n";
+	}
+
+	stream << "\nTop symbols by relocation fan-in:\n";
+	for (const auto &symbol : getTopSymbols(report, topSymbolCount))
+	{
+		stream << std::setw(10) << symbol.second << "  " << symbol.first << "\n";
+	}
+}
+
+std::string escapeJson(const std::string &str)
+{
+	std::string escaped;
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+			escaped += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+			escaped += buffer;
+		}
+		else
+		{
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+void writeReportJson(std::ostream &stream, const RelocationReport &report, int topSymbolCount)
+{
+	stream << "{\n";
+	stream << "  \"emitted\": " << getEmittedCount(report) << ",\n";
+	stream << "  \"deferred\": " << report.deferred << ",\n";
+	stream << "  \"earlyResolved\": " << report.earlyResolved << ",\n";
+	stream << "  \"relaxed\": " << report.relaxed << ",\n";
+	stream << "  \"lazyCalls\": " << report.lazyCalls << ",\n";
+	stream << "  \"unresolved\": " << report.unresolved << ",\n";
+	stream << "  \"importBytes\": " << report.importBytes << ",\n";
+	stream << "  \"relocationBytes\": " << report.relocationBytes << ",\n";
+	stream << "  \"fixedRelocationBytes\": " << report.fixedRelocationBytes << ",\n";
+	stream << "  \"initBytes\": " << report.initBytes << ",\n";
+	stream << "  \"zeroDataBytes\": " << report.zeroDataBytes << ",\n";
+	stream << "  \"cachedSections\": " << report.cachedSections << ",\n";
+	stream << "  \"reusedSections\": " << report.reusedSections << ",\n";
+	stream << "  \"estimatedCycles\": " << report.estimatedCycles << ",\n";
+
+	stream << "  \"modules\": [";
+	const char *separator = "\n";
+	for (const auto &module : report.modules)
+	{
+		stream << separator << "    { \"id\": " << module.first
+			   << ", \"count\": " << module.second.count
+			   << ", \"bytes\": " << module.second.bytes << " }";
+		separator = ",\n";
+	}
+	stream << "\n  ],\n";
+
+	stream << "  \"sections\": [";
+	separator = "\n";
+	for (const auto &section : report.sections)
+	{
+		stream << separator << "    { \"index\": " << section.first
+			   << ", \"name\": \"" << escapeJson(getSectionName(report, section.first)) << "\""
+			   << ", \"count\": " << section.second.count
+			   << ", \"bytes\": " << section.second.bytes << " }";
+		separator = ",\n";
+	}
+	stream << "\n  ],\n";
+
+	stream << "  \"types\": [";
+	separator = "\n";
+	for (const auto &type : report.types)
+	{
+		stream << separator << "    { \"type\": \"" << getRelocationTypeName(type.first) << "\""
+			   << ", \"count\": " << type.second.count
+			   << ", \"bytes\": " << type.second.bytes << " }";
+		separator = ",\n";
+	}
+	stream << "\n  ],\n";
+
+	stream << "  \"topSymbols\": [";
+	separator = "\n";
+	for (const auto &symbol : getTopSymbols(report, topSymbolCount))
+	{
+		stream << separator << "    { \"name\": \"" << escapeJson(symbol.first) << "\""
+			   << ", \"relocations\": " << symbol.second << " }";
+		separator = ",\n";
+	}
+	stream << "\n  ]\n";
+	stream << "}\n";
+}
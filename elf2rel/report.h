@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+struct RelocationStats
+{
+	int count = 0;
+	int bytes = 0;
+};
+
+// Relocation cost and footprint of a converted module
+struct RelocationReport
+{
+	std::map<uint32_t, RelocationStats> modules;
+	std::map<uint32_t, RelocationStats> sections;
+	std::map<uint32_t, std::string> sectionNames;
+	std::map<int, RelocationStats> types;
+	std::map<std::string, int, std::less<>> symbolFanIn;
+
+	int earlyResolved = 0;
+	int relaxed = 0; // lis/addi pairs that no longer need relocations
+	int lazyCalls = 0; // calls into other modules through lazy binding stubs
+	int unresolved = 0;
+	int deferred = 0; // against the dol or this module, applied once and trimmed by OSLinkFixed
+	int importBytes = 0;
+	int relocationBytes = 0;
+	int fixedRelocationBytes = 0;
+	int initBytes = 0; // init sections freed together with the trimmed relocations
+	int zeroDataBytes = 0; // all-zero data placed in bss instead of the REL
+	int cachedSections = 0; // sections whose resolved relocations went to the relocation cache
+	int reusedSections = 0; // of those, sections taken from the cache instead of resolved again
+	uint64_t estimatedCycles = 0;
+
+	// Records one entry written to the relocation table
+	void addRecord(uint32_t moduleID, int section, int type);
+};
+
+const char *getRelocationTypeName(int type);
+
+// Estimated cycles OSLink spends on one relocation table entry
+int getRecordCost(int type);
+
+// Escapes a string for use inside a JSON string literal
+std::string escapeJson(const std::string &str);
+
+void writeReportText(std::ostream &stream, const RelocationReport &report, int topSymbolCount);
+void writeReportJson(std::ostream &stream, const RelocationReport &report, int topSymbolCount);
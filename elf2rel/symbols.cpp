@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright 2019 Linus S. (aka PistonMiner)
+
+#include "symbols.h"
+
+#include "elf2rel.h"
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <charconv>
+#include <cstring>
+
+static std::string_view trim(std::string_view str)
+{
+	const char *whitespace = " \t\r\n\v\f";
+	size_t first = str.find_first_not_of(whitespace);
+	if (first == std::string_view::npos)
+	{
+		return std::string_view();
+	}
+	return str.substr(first, str.find_last_not_of(whitespace) - first + 1);
+}
+
+// Accepts the same numbers as std::stoul, base 0 detects 0x and 0 prefixes and
+// base 16 allows an 0x prefix
+static bool parseInt(std::string_view str, uint32_t &out, int base)
+{
+	if ((base == 0 || base == 16) && str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+	{
+		str.remove_prefix(2);
+		base = 16;
+	}
+	else if (base == 0)
+	{
+		base = str.size() > 1 && str[0] == '0' ? 8 : 10;
+	}
+
+	unsigned long value;
+	auto result = std::from_chars(str.data(), str.data() + str.size(), value, base);
+	if (str.empty() || result.ec != std::errc() || result.ptr != str.data() + str.size())
+	{
+		return false;
+	}
+	out = static_cast<uint32_t>(value);
+	return true;
+}
+
+// dol symbols: addr:symbolName
+// rel symbols: module,section,offset:symbolName
+// module and section can be prefixed with 0x for hex or 0 for octal, addr/offset is always hex
+bool parseSymbol(std::string_view line, SymbolLocation &sym, std::string_view &name)
+{
+	// Split around colon
+	size_t colon = line.find(':');
+	if (colon == std::string_view::npos || line.find(':', colon + 1) != std::string_view::npos)
+	{
+		return false;
+	}
+	name = trim(line.substr(colon + 1));
+	std::string_view location = trim(line.substr(0, colon));
+
+	// Split first part around commas
+	size_t firstComma = location.find(',');
+	if (firstComma == std::string_view::npos)
+	{
+		// Dol
+		sym.moduleId = 0;
+		sym.targetSection = 0;
+		return parseInt(location, sym.addr, 16);
+	}
+
+	size_t secondComma = location.find(',', firstComma + 1);
+	if (secondComma == std::string_view::npos || location.find(',', secondComma + 1) != std::string_view::npos)
+	{
+		return false;
+	}
+
+	// Other rel
+	return parseInt(trim(location.substr(0, firstComma)), sym.moduleId, 0)
+		&& parseInt(trim(location.substr(firstComma + 1, secondComma - firstComma - 1)), sym.targetSection, 0)
+		&& parseInt(trim(location.substr(secondComma + 1)), sym.addr, 16);
+}
+
+// Binary symbol maps start with this magic, followed by a version, the entry
+// count and the string table size. Each entry is the module ID, section,
+// offset and the offset of its name in the string table that follows.
+const uint32_t cBinarySymbolMapMagic = 0x45325253; // 'E2RS'
+const uint32_t cBinarySymbolMapVersion = 1;
+
+bool loadBinarySymbolMap(const std::vector<uint8_t> &data, Arena &arena, SymbolMap &outputMap)
+{
+	const size_t headerSize = 16;
+	const size_t entrySize = 16;
+	if (data.size() < headerSize || loadAt<uint32_t>(data, 4) != cBinarySymbolMapVersion)
+	{
+		return false;
+	}
+	uint32_t count = loadAt<uint32_t>(data, 8);
+	uint32_t stringTableSize = loadAt<uint32_t>(data, 12);
+	size_t stringTableOffset = headerSize + static_cast<size_t>(count) * entrySize;
+	if (stringTableOffset + stringTableSize > data.size())
+	{
+		return false;
+	}
+
+	const char *stringTable = reinterpret_cast<const char *>(data.data() + stringTableOffset);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		size_t entryOffset = headerSize + i * entrySize;
+		SymbolLocation sym;
+		sym.moduleId = loadAt<uint32_t>(data, entryOffset);
+		sym.targetSection = loadAt<uint32_t>(data, entryOffset + 4);
+		sym.addr = loadAt<uint32_t>(data, entryOffset + 8);
+		uint32_t nameOffset = loadAt<uint32_t>(data, entryOffset + 12);
+		if (nameOffset >= stringTableSize)
+		{
+			return false;
+		}
+		std::string_view name(stringTable + nameOffset, strnlen(stringTable + nameOffset, stringTableSize - nameOffset));
+		outputMap.insert_or_assign(arena.intern(name), sym);
+	}
+	return true;
+}
+
+void loadSymbolMap(const std::string &filename, Arena &arena, SymbolMap &outputMap)
+{
+	// Later lines override earlier ones within a file, but not symbols that
+	// were already in the map. Nodes are spliced over without copying.
+	SymbolMap fileMap(arena.getResource());
+
+	std::ifstream inputStream(filename, std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(inputStream)), std::istreambuf_iterator<char>());
+
+	// Binary maps are loaded directly
+	if (data.size() >= 4 && loadAt<uint32_t>(data, 0) == cBinarySymbolMapMagic)
+	{
+		if (!loadBinarySymbolMap(data, arena, fileMap))
+		{
+			std::cerr << "Invalid binary symbol map: " << filename << std::endl;
+		}
+		outputMap.merge(fileMap);
+		return;
+	}
+
+	std::string_view text(reinterpret_cast<const char *>(data.data()), data.size());
+	while (!text.empty())
+	{
+		size_t lineEnd = text.find('\n');
+		std::string_view line = text.substr(0, lineEnd);
+		text.remove_prefix(lineEnd == std::string_view::npos ? text.size() : lineEnd + 1);
+
+		size_t lineStart = line.find_first_not_of(" \t\r\n\v\f");
+		line.remove_prefix(lineStart == std::string_view::npos ? line.size() : lineStart);
+
+		// Ignore comments
+		if (line.size() == 0 || line[0] == '/')
+		{
+			continue;
+		}
+
+		// Try parse line
+		SymbolLocation sym;
+		std::string_view name;
+		if (!parseSymbol(line, sym, name))
+		{
+			std::cerr << "Invalid symbol: " << line << std::endl;
+			continue;
+		}
+		fileMap.insert_or_assign(arena.intern(name), sym);
+	}
+
+	outputMap.merge(fileMap);
+}
+
+bool loadSymbolList(const std::string &filename, std::vector<std::string> &names)
+{
+	std::ifstream inputStream(filename);
+	if (!inputStream)
+	{
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(inputStream, line))
+	{
+		std::string_view name = trim(line);
+		if (name.empty() || name[0] == '#')
+		{
+			continue;
+		}
+		names.emplace_back(name);
+	}
+	return true;
+}
+
+// Writes symbols in the module,section,offset:name format read by parseSymbol
+void writeSymbolMap(std::ostream &stream, const std::vector<std::pair<std::string, SymbolLocation>> &symbols)
+{
+	char location[64];
+	for (const auto &symbol : symbols)
+	{
+		snprintf(location, sizeof(location), "%u,%u,%08x:",
+				 symbol.second.moduleId,
+				 symbol.second.targetSection,
+				 symbol.second.addr);
+		stream << location << symbol.first << "\n";
+	}
+}
+
+void writeBinarySymbolMap(std::vector<uint8_t> &buffer, const std::vector<std::pair<std::string, SymbolLocation>> &symbols)
+{
+	std::vector<uint8_t> stringTable;
+	save<uint32_t>(buffer, cBinarySymbolMapMagic);
+	save<uint32_t>(buffer, cBinarySymbolMapVersion);
+	save<uint32_t>(buffer, static_cast<uint32_t>(symbols.size()));
+	size_t stringTableSizeOffset = buffer.size();
+	save<uint32_t>(buffer, 0);
+	for (const auto &symbol : symbols)
+	{
+		save<uint32_t>(buffer, symbol.second.moduleId);
+		save<uint32_t>(buffer, symbol.second.targetSection);
+		save<uint32_t>(buffer, symbol.second.addr);
+		save<uint32_t>(buffer, static_cast<uint32_t>(stringTable.size()));
+		stringTable.insert(stringTable.end(), symbol.first.begin(), symbol.first.end());
+		stringTable.push_back(0);
+	}
+	std::vector<uint8_t> stringTableSize;
+	save<uint32_t>(stringTableSize, static_cast<uint32_t>(stringTable.size()));
+	std::copy(stringTableSize.begin(), stringTableSize.end(), buffer.begin() + stringTableSizeOffset);
+	buffer.insert(buffer.end(), stringTable.begin(), stringTable.end());
+}
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright 2019 Linus S. (aka PistonMiner)
+
+#pragma once
+
+#include "arena.h"
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+struct SymbolLocation
+{
+	uint32_t moduleId; // 0 means dol
+	uint32_t targetSection; // OSLink ignores for dol
+	uint32_t addr;
+};
+
+// Symbol name to location. The names are owned by the arena the map was loaded
+// with, which must outlive the map.
+using SymbolMap = std::pmr::map<std::string_view, SymbolLocation, std::less<>>;
+
+// Parses a single symbol map line without allocating, name points into line
+bool parseSymbol(std::string_view line, SymbolLocation &sym, std::string_view &name);
+
+// Loads a text or binary symbol map into outputMap. Symbols already in the map
+// take precedence over the ones in the file.
+void loadSymbolMap(const std::string &filename, Arena &arena, SymbolMap &outputMap);
+bool loadBinarySymbolMap(const std::vector<uint8_t> &data, Arena &arena, SymbolMap &outputMap);
+
+// Loads a list of symbol names, one per line. Empty lines and lines starting
+// with # are ignored.
+bool loadSymbolList(const std::string &filename, std::vector<std::string> &names);
+
+// Writes symbols in the text and binary symbol map formats
+void writeSymbolMap(std::ostream &stream, const std::vector<std::pair<std::string, SymbolLocation>> &symbols);
+void writeBinarySymbolMap(std::vector<uint8_t> &buffer, const std::vector<std::pair<std::string, SymbolLocation>> &symbols);
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "trace.h"
+
+#include "report.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent
+{
+	const char *name;
+	std::string detail;
+	int64_t start; // microseconds since the trace was enabled
+	int64_t duration;
+	int threadID;
+};
+
+static std::atomic<bool> traceEnabled(false);
+static std::chrono::steady_clock::time_point traceStart;
+static std::mutex traceMutex;
+static std::vector<TraceEvent> traceEvents;
+static std::atomic<int> nextThreadID(1);
+
+// Small stable IDs instead of the platform's thread IDs, the main thread is 1
+static int getThreadID()
+{
+	thread_local int threadID = nextThreadID++;
+	return threadID;
+}
+
+void enableTrace()
+{
+	traceStart = std::chrono::steady_clock::now();
+	getThreadID();
+	traceEnabled = true;
+}
+
+bool isTraceEnabled()
+{
+	return traceEnabled;
+}
+
+TraceScope::TraceScope(const char *name, std::string_view detail)
+	: name(name), enabled(traceEnabled)
+{
+	if (enabled)
+	{
+		this->detail = detail;
+		start = std::chrono::steady_clock::now();
+	}
+}
+
+TraceScope::~TraceScope()
+{
+	if (!enabled)
+	{
+		return;
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	TraceEvent event;
+	event.name = name;
+	event.detail = std::move(detail);
+	event.start = std::chrono::duration_cast<std::chrono::microseconds>(start - traceStart).count();
+	event.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	event.threadID = getThreadID();
+
+	std::lock_guard<std::mutex> lock(traceMutex);
+	traceEvents.emplace_back(std::move(event));
+}
+
+bool writeTrace(const std::string &filename)
+{
+	std::ofstream stream(filename);
+	if (!stream)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(traceMutex);
+	stream << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n";
+	stream << "    { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": { \"name\": \"elf2rel\" } }";
+	for (int threadID = 1; threadID < nextThreadID; ++threadID)
+	{
+		stream << ",\n    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << threadID
+			   << ", \"args\": { \"name\": \"" << (threadID == 1 ? "main" : "worker " + std::to_string(threadID - 1)) << "\" } }";
+	}
+	for (const auto &event : traceEvents)
+	{
+		stream << ",\n    { \"name\": \"" << escapeJson(event.name) << "\", \"cat\": \"elf2rel\", \"ph\": \"X\""
+			   << ", \"ts\": " << event.start
+			   << ", \"dur\": " << event.duration
+			   << ", \"pid\": 1, \"tid\": " << event.threadID;
+		if (!event.detail.empty())
+		{
+			stream << ", \"args\": { \"detail\": \"" << escapeJson(event.detail) << "\" }";
+		}
+		stream << " }";
+	}
+	stream << "\n  ]\n}\n";
+	return static_cast<bool>(stream);
+}
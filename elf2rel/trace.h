@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+// Timeline of a conversion in the Chrome trace event format, which can be
+// opened in Perfetto or chrome://tracing. Tracing is off unless enabled, in
+// which case scopes cost nothing but a flag check.
+void enableTrace();
+bool isTraceEnabled();
+bool writeTrace(const std::string &filename);
+
+// Records a complete event from construction to destruction on the current
+// thread. The detail is shown as an argument of the event, e.g. a filename,
+// and is only copied when tracing is enabled.
+class TraceScope
+{
+public:
+	explicit TraceScope(const char *name, std::string_view detail = std::string_view());
+	~TraceScope();
+	TraceScope(const TraceScope &) = delete;
+	TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+	const char *name;
+	std::string detail;
+	std::chrono::steady_clock::time_point start;
+	bool enabled;
+};
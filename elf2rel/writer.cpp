@@ -0,0 +1,234 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "writer.h"
+
+#include "elf2rel.h"
+
+#include <algorithm>
+#include <fstream>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
+
+static std::vector<uint8_t> getPatchBytes(const RelPatch &patch)
+{
+	std::vector<uint8_t> bytes;
+	save<uint32_t>(bytes, patch.value);
+	return bytes;
+}
+
+void writeRel(std::ostream &stream, const RelModule &module)
+{
+	stream.write(reinterpret_cast<const char *>(module.headerBuffer.data()), module.headerBuffer.size());
+
+	// Coalesced sections are not in input order and the generated sections
+	// can be placed between them
+	struct Piece
+	{
+		int offset;
+		const char *data;
+		int size;
+	};
+	std::vector<Piece> pieces;
+	for (size_t i = 0; i < module.sectionPlacements.size(); ++i)
+	{
+		const SectionPlacement &placement = module.sectionPlacements[i];
+		if (placement.placed && !placement.bss)
+		{
+			pieces.push_back({ placement.offset, module.inputElf.sections[i]->get_data(), placement.size });
+		}
+	}
+	for (const GeneratedSection *generated : { &module.exportTable, &module.stubTable })
+	{
+		if (!generated->data.empty())
+		{
+			pieces.push_back({ generated->offset,
+							   reinterpret_cast<const char *>(generated->data.data()),
+							   static_cast<int>(generated->data.size()) });
+		}
+	}
+	std::stable_sort(pieces.begin(), pieces.end(), [](const Piece &left, const Piece &right)
+	{
+		return left.offset < right.offset;
+	});
+
+	int fileOffset = static_cast<int>(module.headerBuffer.size());
+	const char padding[32] = {};
+	auto writePadding = [&](int offset)
+	{
+		while (fileOffset < offset)
+		{
+			int count = std::min(offset - fileOffset, static_cast<int>(sizeof(padding)));
+			stream.write(padding, count);
+			fileOffset += count;
+		}
+	};
+	for (const auto &piece : pieces)
+	{
+		writePadding(piece.offset);
+		stream.write(piece.data, piece.size);
+		fileOffset += piece.size;
+	}
+	writePadding(module.tableOffset);
+
+	if (!module.options.splitRelocations)
+	{
+		stream.write(reinterpret_cast<const char *>(module.tableBuffer.data()), module.tableBuffer.size());
+	}
+
+	for (const auto &patch : module.patches)
+	{
+		std::vector<uint8_t> bytes = getPatchBytes(patch);
+		stream.seekp(patch.offset);
+		stream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+	}
+	stream.seekp(0, std::ios::end);
+}
+
+#ifdef __linux__
+static bool writeAt(int fd, const void *data, size_t size, off_t offset)
+{
+	const char *bytes = static_cast<const char *>(data);
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, size, offset);
+		if (written <= 0)
+		{
+			return false;
+		}
+		bytes += written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+// Copies inside the kernel, copy_file_range is not supported across file
+// systems on older kernels and sendfile may be unavailable for some files.
+// Returns false without having written anything unrecoverable, the caller
+// then writes the data from memory.
+static bool copyFileData(int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t copied = copy_file_range(inputFd, &inputOffset, outputFd, &outputOffset, size, 0);
+		if (copied <= 0)
+		{
+			break;
+		}
+		size -= copied;
+	}
+	if (size == 0)
+	{
+		return true;
+	}
+
+	if (lseek(outputFd, outputOffset, SEEK_SET) != outputOffset)
+	{
+		return false;
+	}
+	while (size > 0)
+	{
+		ssize_t copied = sendfile(outputFd, inputFd, &inputOffset, size);
+		if (copied <= 0)
+		{
+			return false;
+		}
+		size -= copied;
+	}
+	return true;
+}
+
+// ELFIO keeps the file offsets of sections to itself, read sh_offset from the
+// section header instead
+static bool getSectionFileOffset(int inputFd, const ELFIO::elfio &inputElf, int sectionIndex, off_t &offset)
+{
+	bool is64 = inputElf.get_class() == ELFCLASS64;
+	off_t headerOffset = inputElf.get_sections_offset()
+		+ static_cast<off_t>(sectionIndex) * inputElf.get_section_entry_size()
+		+ (is64 ? 24 : 16);
+	uint8_t bytes[8];
+	size_t size = is64 ? 8 : 4;
+	if (pread(inputFd, bytes, size, headerOffset) != static_cast<ssize_t>(size))
+	{
+		return false;
+	}
+
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		size_t byteIndex = inputElf.get_encoding() == ELFDATA2MSB ? i : size - 1 - i;
+		value = (value << 8) | bytes[byteIndex];
+	}
+	offset = static_cast<off_t>(value);
+	return true;
+}
+
+bool writeRelFile(const RelModule &module, const std::string &filename)
+{
+	int outputFd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (outputFd < 0)
+	{
+		return false;
+	}
+	int inputFd = open(module.elfFilename.c_str(), O_RDONLY);
+
+	// Padding between sections is left as a hole in the file
+	off_t fileSize = module.tableOffset + static_cast<off_t>(module.options.splitRelocations ? 0 : module.tableBuffer.size());
+	bool succeeded = ftruncate(outputFd, fileSize) == 0
+		&& writeAt(outputFd, module.headerBuffer.data(), module.headerBuffer.size(), 0);
+	for (size_t i = 0; succeeded && i < module.sectionPlacements.size(); ++i)
+	{
+		const SectionPlacement &placement = module.sectionPlacements[i];
+		if (!placement.placed || placement.bss || placement.size == 0)
+		{
+			continue;
+		}
+		ELFIO::section *section = module.inputElf.sections[i];
+		off_t inputOffset;
+		if (inputFd < 0
+			|| placement.modified
+			|| !getSectionFileOffset(inputFd, module.inputElf, static_cast<int>(i), inputOffset)
+			|| !copyFileData(inputFd, inputOffset, outputFd, placement.offset, placement.size))
+		{
+			succeeded = writeAt(outputFd, section->get_data(), placement.size, placement.offset);
+		}
+	}
+	for (const GeneratedSection *generated : { &module.exportTable, &module.stubTable })
+	{
+		succeeded = succeeded && writeAt(outputFd, generated->data.data(), generated->data.size(), generated->offset);
+	}
+	if (!module.options.splitRelocations)
+	{
+		succeeded = succeeded && writeAt(outputFd, module.tableBuffer.data(), module.tableBuffer.size(), module.tableOffset);
+	}
+	for (const auto &patch : module.patches)
+	{
+		std::vector<uint8_t> bytes = getPatchBytes(patch);
+		succeeded = succeeded && writeAt(outputFd, bytes.data(), bytes.size(), patch.offset);
+	}
+
+	if (inputFd >= 0)
+	{
+		close(inputFd);
+	}
+	return close(outputFd) == 0 && succeeded;
+}
+#else
+bool writeRelFile(const RelModule &module, const std::string &filename)
+{
+	std::ofstream outputStream(filename, std::ios::binary);
+	writeRel(outputStream, module);
+	return static_cast<bool>(outputStream);
+}
+#endif
+
+bool writeRelocationFile(const RelModule &module, const std::string &filename)
+{
+	std::ofstream outputStream(filename, std::ios::binary);
+	outputStream.write(reinterpret_cast<const char *>(module.tableBuffer.data()), module.tableBuffer.size());
+	return static_cast<bool>(outputStream);
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "convert.h"
+
+#include <ostream>
+#include <string>
+
+// Writes a linked module's REL. On Linux section data is copied from the input
+// ELF to the output file by the kernel where possible, so the REL is never
+// held in memory as a whole.
+bool writeRelFile(const RelModule &module, const std::string &filename);
+
+// Writes a linked module's REL to a seekable stream
+void writeRel(std::ostream &stream, const RelModule &module);
+
+// Writes the imports and relocations of a module linked with split
+// relocations
+bool writeRelocationFile(const RelModule &module, const std::string &filename);